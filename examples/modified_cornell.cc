@@ -106,4 +106,6 @@ int main(int argc, char** argv) {
         bvh.add_triangle(Triangle(tb17, tb19, tb20, green_diffuse));
         render_gpu(camera, bvh, 10000, 5, ivec2(64, 64), argv[1] + std::to_string(r) + ".png");
     }
+    // images are saved in the background while the next variant renders
+    if (!write_queue().flush()) return 1;
 }
\ No newline at end of file
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "exr.h"
+#include "image.h"
+#include "linalg.h"
+#include "triangle.h"
+
+// what a camera ray sees at its first hit
+struct AOVSample {
+    vec3 normal = 0;  // zero if the ray missed
+    vec3 albedo = 0;
+    float depth = 0;        // distance along the ray
+    int triangle_id = -1;   // index into bvh.triangles, -1 if the ray missed
+};
+
+// materials are stored per triangle, equal materials share an id
+// ids are handed out in order of first appearance
+std::vector<int> material_ids(const std::vector<Triangle>& triangles) {
+    std::vector<int> ids(triangles.size());
+    std::vector<const Material*> distinct;
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const Material& m = triangles[i].material;
+        size_t id = 0;
+        for (; id < distinct.size(); id++) {
+            const Material& d = *distinct[id];
+            if (d.type == m.type && d.color == m.color && d.emit_color == m.emit_color &&
+                d.roughness == m.roughness)
+                break;
+        }
+        if (id == distinct.size()) distinct.push_back(&m);
+        ids[i] = id;
+    }
+    return ids;
+}
+
+// first hit buffers summed over the samples of each pixel,
+// same layout as the beauty Image (row 0 is the bottom)
+// ids can't be averaged, they come from the first sample of the pixel that hit anything
+struct AOVs {
+    ivec2 res;
+    Image normal, albedo;
+    std::vector<float> depth;
+    std::vector<int> triangle_id, material_id;
+
+    AOVs() = default;
+    AOVs(const ivec2& resolution)
+        : res(resolution),
+          normal(resolution),
+          albedo(resolution),
+          depth(size_t(resolution.x) * resolution.y, 0),
+          triangle_id(size_t(resolution.x) * resolution.y, -1),
+          material_id(size_t(resolution.x) * resolution.y, -1) {}
+
+    void add(int w, int h, const AOVSample& sample) {
+        size_t i = size_t(h) * res.x + w;
+        normal.pixel(w, h) += sample.normal;
+        albedo.pixel(w, h) += sample.albedo;
+        depth[i] += sample.depth;
+        if (triangle_id[i] == -1) triangle_id[i] = sample.triangle_id;
+    }
+    // sums to means
+    void average(int samples) {
+        normal /= samples;
+        albedo /= samples;
+        float inv = 1.0f / samples;
+        for (float& d : depth) d *= inv;
+    }
+    // fills material_id from triangle_id
+    void resolve_materials(const std::vector<Triangle>& triangles) {
+        std::vector<int> ids = material_ids(triangles);
+        for (size_t i = 0; i < triangle_id.size(); i++)
+            material_id[i] = triangle_id[i] == -1 ? -1 : ids[triangle_id[i]];
+    }
+
+    // all buffers in one exr next to the beauty image, averaged over samples
+    // channels follow the usual compositing names, ids are stored as uint
+    // with 0 for misses and id + 1 otherwise
+    bool save(const std::string& filename, int samples = 1) const {
+        const std::vector<ExrWriter::Channel> channels = {
+            {"albedo.R", ExrWriter::HALF},      {"albedo.G", ExrWriter::HALF},
+            {"albedo.B", ExrWriter::HALF},      {"N.X", ExrWriter::HALF},
+            {"N.Y", ExrWriter::HALF},           {"N.Z", ExrWriter::HALF},
+            {"Z", ExrWriter::FLOAT},            {"materialId", ExrWriter::UINT},
+            {"triangleId", ExrWriter::UINT},
+        };
+        std::vector<float> line(size_t(res.x) * channels.size());
+        const float* planes[9];
+        for (size_t c = 0; c < channels.size(); c++) planes[c] = &line[c * res.x];
+
+        ExrWriter exr;
+        bool success = exr.open(filename, res, channels, {{"samples", samples}});
+        for (int h = res.y - 1; success && h >= 0; h--) {
+            for (int w = 0; w < res.x; w++) {
+                size_t i = size_t(h) * res.x + w;
+                const vec3 &a = albedo.pixel(w, h), &n = normal.pixel(w, h);
+                float* dst = &line[w];
+                dst[0] = a.x, dst[res.x] = a.y, dst[2 * res.x] = a.z;
+                dst[3 * res.x] = n.x, dst[4 * res.x] = n.y, dst[5 * res.x] = n.z;
+                dst[6 * res.x] = depth[i];
+                // ids go through float, exact below 2^24
+                dst[7 * res.x] = material_id[i] + 1;
+                dst[8 * res.x] = triangle_id[i] + 1;
+            }
+            // the ids are not scaled, the rest is averaged
+            float inv = 1.0f / samples;
+            for (size_t c = 0; c < 7 * size_t(res.x); c++) line[c] *= inv;
+            exr.write_line(planes);
+        }
+        success = success && exr.close();
+        if (!success) std::cerr << "Failed to write image to file: " << filename << '\n';
+        return success;
+    }
+};
+
+// beauty.png -> beauty.aov.exr
+std::string aov_filename(const std::string& filename) {
+    return sidecar_filename(filename, ".aov.exr");
+}
@@ -27,11 +27,30 @@ struct BVHNode {
     }
 };
 
+// node of the threaded (stackless) layout of a BVH
+// nodes are stored depth first, so the first child of a node is the node right
+// after it, and escape is the node that follows its whole subtree: where to go
+// once the node is missed or its triangles are done, nodes.size() at the end
+struct ThreadedNode {
+    AABB aabb;
+    int escape;
+    int tri_start, tri_end;  // -1 for inner nodes
+
+    ThreadedNode() = default;
+    ThreadedNode(const AABB& aabb, int escape, int tri_start, int tri_end)
+        : aabb(aabb), escape(escape), tri_start(tri_start), tri_end(tri_end) {}
+
+    bool is_leaf() const {
+        return tri_start != -1;
+    }
+};
+
 struct BVH {
     bool built = false;
     std::vector<Triangle> triangles;
     std::vector<int> tri_idx;
     std::vector<BVHNode> nodes;
+    std::vector<ThreadedNode> threaded;  // same tree, see ThreadedNode
 
     BVH() = default;
 
@@ -151,8 +170,36 @@ struct BVH {
             cur.right = right;
             stack.push_back(right);
         }
+        thread();
         built = true;
     }
+    void thread() {
+        // lays nodes out depth first with escape links, right child first so
+        // nodes are visited in the same order as the stack in intersect
+
+        // children are always stored after their parent
+        std::vector<int> subtree(nodes.size(), 1);
+        for (int i = int(nodes.size()) - 1; i >= 0; i--) {
+            if (!nodes[i].is_leaf()) subtree[i] += subtree[nodes[i].left] + subtree[nodes[i].right];
+        }
+
+        threaded.clear();
+        threaded.reserve(nodes.size());
+        std::deque<int> stack;
+        stack.push_back(0);
+        while (!stack.empty()) {
+            const BVHNode& cur = nodes[stack.back()];
+            int escape = threaded.size() + subtree[stack.back()];
+            stack.pop_back();
+            if (cur.is_leaf()) {
+                threaded.push_back(ThreadedNode(cur.aabb, escape, cur.tri_start, cur.tri_end));
+            } else {
+                threaded.push_back(ThreadedNode(cur.aabb, escape, -1, -1));
+                stack.push_back(cur.left);
+                stack.push_back(cur.right);
+            }
+        }
+    }
     int intersect(const vec3& ray_o, const vec3& ray_d, float& t) const {
         vec3 inv_ray_d = 1 / ray_d;
         std::deque<int> stack;
@@ -181,6 +228,34 @@ struct BVH {
 
         return ret;
     }
+    int intersect_stackless(const vec3& ray_o, const vec3& ray_d, float& t) const {
+        // same result as intersect without a stack, walks the threaded layout:
+        // a hit inner node goes on to its first child, everything else escapes
+        vec3 inv_ray_d = 1 / ray_d;
+        int ret = -1;
+        t = FLOAT_INF;
+        int idx = 0, end = threaded.size();
+        while (idx < end) {
+            const ThreadedNode& cur = threaded[idx];
+            if (!cur.aabb.intersect_inv(ray_o, inv_ray_d)) {
+                idx = cur.escape;
+            } else if (cur.is_leaf()) {
+                for (int i = cur.tri_start; i <= cur.tri_end; i++) {
+                    float t_;
+                    const Triangle& tri = triangles[tri_idx[i]];
+                    if (tri.intersect(ray_o, ray_d, t_) && t_ < t) {
+                        t = t_;
+                        ret = tri_idx[i];
+                    }
+                }
+                idx = cur.escape;
+            } else {
+                idx++;
+            }
+        }
+
+        return ret;
+    }
     void load_obj(const std::string& filename, const std::string& mtl_path = "./") {
         tinyobj::ObjReaderConfig reader_config;
         reader_config.mtl_search_path = mtl_path;
@@ -61,8 +61,13 @@ struct Camera {
     }
 
     void get_ray(int w, int h, vec3& ray_o, vec3& ray_d) const {
-        ray_d = vec3((w + rng.rand01()) * cell_size - v_res.x / 2,
-                     (h + rng.rand01()) * cell_size - v_res.y / 2, -distance);
+        float jitter_x = rng.rand01(), jitter_y = rng.rand01();
+        get_ray(w, h, vec2(jitter_x, jitter_y), ray_o, ray_d);
+    }
+    void get_ray(int w, int h, const vec2& jitter, vec3& ray_o, vec3& ray_d) const {
+        // jitter is the sub pixel offset in [0, 1)
+        ray_d = vec3((w + jitter.x) * cell_size - v_res.x / 2,
+                     (h + jitter.y) * cell_size - v_res.y / 2, -distance);
         // transform[x * 4 + y] is the same as transform[x][y] if mat4
         ray_d =
             vec3(ray_d.dot(vec3(transform[0 * 4 + 0], transform[1 * 4 + 0], transform[2 * 4 + 0])),
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "camera.h"
+#include "image.h"
+#include "linalg.h"
+#include "stats.h"
+
+#define CHECKPOINT_MAGIC 0x4b435450u  // "PTCK"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_INTERVAL 60.0f     // seconds
+
+// fnv-1a over everything that changes the rendered result
+struct SceneHash {
+    uint64_t value = 1469598103934665603ull;
+
+    void add(const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            value ^= bytes[i];
+            value *= 1099511628211ull;
+        }
+    }
+    void add(float f) {
+        add(&f, sizeof(f));
+    }
+    void add(int i) {
+        add(&i, sizeof(i));
+    }
+    void add(const vec3& v) {
+        add(v.x), add(v.y), add(v.z);
+    }
+};
+
+uint64_t scene_hash(const Camera& camera, const BVH& bvh, int samples, int depth) {
+    // fields are hashed one by one so struct padding never leaks in
+    SceneHash hash;
+    hash.add(camera.pos), hash.add(camera.forward), hash.add(camera.up);
+    hash.add(camera.res.x), hash.add(camera.res.y);
+    hash.add(camera.fov), hash.add(camera.distance);
+    hash.add(samples), hash.add(depth);
+    hash.add(static_cast<int>(bvh.triangles.size()));
+    for (const Triangle& tri : bvh.triangles) {
+        hash.add(tri.v1), hash.add(tri.v2), hash.add(tri.v3);
+        hash.add(static_cast<int>(tri.material.type));
+        hash.add(tri.material.color), hash.add(tri.material.emit_color);
+        hash.add(tri.material.roughness);
+    }
+    return hash.value;
+}
+
+// state of an interrupted render_cpu, enough to continue it bit for bit:
+// the accumulation buffer, how many samples every pixel has,
+// the row to continue from and the state of the global rng at that row
+// (plus the per pixel statistics if the render keeps them)
+struct Checkpoint {
+    uint64_t hash = 0;
+    int samples = 0, depth = 0;
+    int next_row = 0;
+    unsigned int rng_state = 0;
+    Image image;
+    std::vector<uint32_t> counts;  // samples taken per pixel
+    PixelStats stats;              // empty unless requested
+
+    Checkpoint() = default;
+    Checkpoint(uint64_t hash, const ivec2& res, int samples, int depth, bool with_stats = false)
+        : hash(hash),
+          samples(samples),
+          depth(depth),
+          image(res),
+          counts(size_t(res.x) * res.y, 0),
+          stats(with_stats ? res : ivec2(0, 0)) {}
+
+    // written to a temporary file first and renamed over the old
+    // checkpoint, so a crash mid write leaves the previous one intact
+    bool save(const std::string& filename) const {
+        std::string tmp = filename + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            auto put = [&](const auto& value) {
+                out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+            };
+            put(CHECKPOINT_MAGIC);
+            put(CHECKPOINT_VERSION);
+            put(hash);
+            put(samples), put(depth);
+            put(image.res.x), put(image.res.y);
+            put(next_row);
+            put(rng_state);
+            out.write(reinterpret_cast<const char*>(image.data()),
+                      image.channels() * sizeof(float));
+            out.write(reinterpret_cast<const char*>(counts.data()),
+                      counts.size() * sizeof(uint32_t));
+            put(static_cast<int>(!stats.empty()));
+            if (!stats.empty()) {
+                out.write(reinterpret_cast<const char*>(stats.count.data()),
+                          stats.count.size() * sizeof(uint32_t));
+                out.write(reinterpret_cast<const char*>(stats.mean.data()),
+                          stats.mean.size() * sizeof(float));
+                out.write(reinterpret_cast<const char*>(stats.m2.data()),
+                          stats.m2.size() * sizeof(float));
+            }
+            out.close();
+            if (out.fail()) {
+                std::cerr << "Failed to write checkpoint: " << tmp << '\n';
+                return false;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(tmp, filename, error);
+        if (error) {
+            std::cerr << "Failed to replace checkpoint: " << filename << '\n';
+            return false;
+        }
+        return true;
+    }
+    bool load(const std::string& filename) {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) return false;
+        auto get = [&](auto& value) { in.read(reinterpret_cast<char*>(&value), sizeof(value)); };
+
+        unsigned int magic;
+        int version;
+        ivec2 res;
+        get(magic), get(version);
+        // version 1 is the same without statistics
+        if (!in || magic != CHECKPOINT_MAGIC || version < 1 || version > CHECKPOINT_VERSION) {
+            std::cerr << "Not a checkpoint file: " << filename << '\n';
+            return false;
+        }
+        get(hash);
+        get(samples), get(depth);
+        get(res.x), get(res.y);
+        get(next_row);
+        get(rng_state);
+        if (!in || res.x <= 0 || res.y <= 0 || next_row < 0 || next_row > res.y) {
+            std::cerr << "Corrupt checkpoint file: " << filename << '\n';
+            return false;
+        }
+
+        image = Image(res);
+        counts.assign(size_t(res.x) * res.y, 0);
+        in.read(reinterpret_cast<char*>(image.data()), image.channels() * sizeof(float));
+        in.read(reinterpret_cast<char*>(counts.data()), counts.size() * sizeof(uint32_t));
+        int has_stats = 0;
+        if (version >= 2) get(has_stats);
+        stats = PixelStats(has_stats ? res : ivec2(0, 0));
+        if (has_stats) {
+            in.read(reinterpret_cast<char*>(stats.count.data()),
+                    stats.count.size() * sizeof(uint32_t));
+            in.read(reinterpret_cast<char*>(stats.mean.data()), stats.mean.size() * sizeof(float));
+            in.read(reinterpret_cast<char*>(stats.m2.data()), stats.m2.size() * sizeof(float));
+        }
+        if (!in) {
+            std::cerr << "Truncated checkpoint file: " << filename << '\n';
+            return false;
+        }
+        return true;
+    }
+};
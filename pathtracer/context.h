@@ -0,0 +1,158 @@
+#pragma once
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "linalg.h"
+
+// an opengl context for offscreen rendering, nothing is ever drawn to its window
+// a hidden glfw window when there is a display server, a surfaceless egl context
+// otherwise, so renders also work in containers and on mesa's llvmpipe without a gpu
+// PATHTRACER_GL=glfw or PATHTRACER_GL=egl picks one regardless of the display
+struct GLContext {
+    GLFWwindow* window = NULL;
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLContext context = EGL_NO_CONTEXT;
+
+    GLContext() = default;
+    GLContext(const GLContext&) = delete;
+    GLContext& operator=(const GLContext&) = delete;
+    ~GLContext() {
+        release();
+    }
+
+    static bool has_display() {
+        return std::getenv("DISPLAY") || std::getenv("WAYLAND_DISPLAY");
+    }
+
+    // major 0 leaves the version to the driver, anything else asks for a core profile
+    bool create(const ivec2& size, const char* title, int major = 0, int minor = 0) {
+        const char* backend = std::getenv("PATHTRACER_GL");
+        bool headless = backend ? std::strcmp(backend, "egl") == 0 : !has_display();
+        if (headless) {
+            if (!create_egl(major, minor)) return false;
+        } else if (!create_glfw(size, title, major, minor)) {
+            // a display that can't be opened, eg. a stale forwarded one
+            if (backend) return false;
+            std::cerr << "Falling back to a headless EGL context\n";
+            if (!create_egl(major, minor)) return false;
+        }
+
+        // glew only knows about glx, the core functions load fine without it
+        glewExperimental = GL_TRUE;
+        GLenum status = glewInit();
+        bool headless_glew = display != EGL_NO_DISPLAY && status == GLEW_ERROR_NO_GLX_DISPLAY;
+        if (status != GLEW_OK && !headless_glew) {
+            std::cerr << "Failed to initialize GLEW\n";
+            release();
+            return false;
+        }
+        return true;
+    }
+    bool create_glfw(const ivec2& size, const char* title, int major, int minor) {
+        if (!glfwInit()) {
+            std::cerr << "Failed to initialize GLFW\n";
+            return false;
+        }
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        if (major > 0) {
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, major);
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minor);
+            glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        }
+        window = glfwCreateWindow(size.x, size.y, title, NULL, NULL);
+        glfwDefaultWindowHints();
+        if (!window) {
+            std::cerr << "Failed to create GLFW window\n";
+            glfwTerminate();
+            return false;
+        }
+        glfwMakeContextCurrent(window);
+        return true;
+    }
+    bool create_egl(int major, int minor) {
+        // the surfaceless platform needs no display server or device node,
+        // older drivers without it still get the default display
+        auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+            eglGetProcAddress("eglGetPlatformDisplayEXT"));
+        if (get_platform_display) {
+            display =
+                get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        }
+        if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        EGLint egl_major, egl_minor;
+        if (display == EGL_NO_DISPLAY || !eglInitialize(display, &egl_major, &egl_minor)) {
+            std::cerr << "Failed to initialize EGL\n";
+            display = EGL_NO_DISPLAY;
+            return false;
+        }
+
+        const char* extensions = eglQueryString(display, EGL_EXTENSIONS);
+        if (!extensions || !std::strstr(extensions, "EGL_KHR_surfaceless_context")) {
+            std::cerr << "EGL display has no surfaceless contexts\n";
+            release();
+            return false;
+        }
+        if (!eglBindAPI(EGL_OPENGL_API)) {
+            std::cerr << "EGL display has no OpenGL\n";
+            release();
+            return false;
+        }
+        // a context never drawn to a surface needs no config, surfaceless
+        // displays only list pbuffer configs for drivers that still want one
+        EGLConfig config = EGL_NO_CONFIG_KHR;
+        if (!std::strstr(extensions, "EGL_KHR_no_config_context")) {
+            EGLint config_attributes[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE,
+                                          EGL_OPENGL_BIT, EGL_NONE};
+            EGLint configs = 0;
+            if (!eglChooseConfig(display, config_attributes, &config, 1, &configs) ||
+                configs == 0) {
+                std::cerr << "EGL display has no OpenGL configs\n";
+                release();
+                return false;
+            }
+        }
+
+        EGLint core_attributes[] = {EGL_CONTEXT_MAJOR_VERSION_KHR,
+                                    major,
+                                    EGL_CONTEXT_MINOR_VERSION_KHR,
+                                    minor,
+                                    EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR,
+                                    EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+                                    EGL_NONE};
+        context = eglCreateContext(display, config, EGL_NO_CONTEXT,
+                                   major > 0 ? core_attributes : NULL);
+        if (context == EGL_NO_CONTEXT) {
+            std::cerr << "Failed to create EGL context\n";
+            release();
+            return false;
+        }
+        // no surface, every render goes to a framebuffer object or a buffer
+        if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+            std::cerr << "Failed to make EGL context current\n";
+            release();
+            return false;
+        }
+        return true;
+    }
+    void release() {
+        if (window) {
+            glfwDestroyWindow(window);
+            glfwTerminate();
+            window = NULL;
+        }
+        if (display != EGL_NO_DISPLAY) {
+            eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+            if (context != EGL_NO_CONTEXT) eglDestroyContext(display, context);
+            eglTerminate(display);
+            display = EGL_NO_DISPLAY;
+            context = EGL_NO_CONTEXT;
+        }
+    }
+};
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "aov.h"
+#include "image.h"
+#include "linalg.h"
+#include "parallel.h"
+
+#define DENOISE_ITERATIONS 5
+
+// e^x for x <= 0, branch free so the filter loops vectorize
+// (2^fraction by a degree 5 polynomial, 2^integer through the exponent bits)
+inline float fast_exp(float x) {
+    float t = x * 1.44269504f;
+    // max(t, -100) without a compare, which would keep gcc from vectorizing,
+    // small enough to be zero for the filter but far from denormals
+    t = 0.5f * (t - 100.0f + std::abs(t + 100.0f));
+    int i = static_cast<int>(t);  // rounds towards zero, f is in (-1, 0]
+    float f = t - i;
+    float p = 1.88757767e-3f;
+    p = p * f + 8.96954307e-3f;
+    p = p * f + 5.58662924e-2f;
+    p = p * f + 2.40153617e-1f;
+    p = p * f + 6.93153073e-1f;
+    p = p * f + 1.0f;
+    int32_t bits = (i + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+// edge avoiding a-trous wavelet filter (dammertz et al. 2010)
+// - the 5x5 b3 spline kernel is applied with holes of 1, 2, 4, ... pixels,
+//   so a few iterations cover a large footprint at 24 taps each
+// - every tap is weighted by how similar its first hit normal, depth and
+//   color are, which keeps geometric edges and shadow boundaries sharp
+// - color is divided by the first hit albedo before filtering and multiplied
+//   back after, so texture and material detail is never blurred
+// - planes are stored per channel with a padded border, so the inner loops
+//   run over contiguous floats without bounds checks and vectorize
+struct Denoiser {
+    int iterations = DENOISE_ITERATIONS;
+    float sigma_color = 1.0f;   // irradiance difference, halves every iteration
+    float sigma_normal = 0.1f;  // 1 - cos of the normal angle
+    float sigma_depth = 1.0f;   // in units of the local depth gradient
+    int threads = 0;            // 0 uses every hardware thread
+
+    Denoiser() = default;
+
+    // one row of every plane, shifted by the tap offset for the neighbours
+    struct RowPlanes {
+        const float *r, *g, *b;
+        const float *nx, *ny, *nz;
+        const float* z;
+    };
+
+    // adds one kernel tap to a whole row, restrict lets gcc vectorize without alias checks
+    static void accumulate_tap(int width, float k, float inv_dist, float inv_sigma_normal,
+                               float inv_sigma_color, const RowPlanes& p,
+                               const float* __restrict depth_scale, const RowPlanes& q,
+                               float* __restrict sum_r, float* __restrict sum_g,
+                               float* __restrict sum_b, float* __restrict sum_w) {
+        for (int x = 0; x < width; x++) {
+            float ndot = p.nx[x] * q.nx[x] + p.ny[x] * q.ny[x] + p.nz[x] * q.nz[x];
+            float dr = p.r[x] - q.r[x], dg = p.g[x] - q.g[x], db = p.b[x] - q.b[x];
+            float e = (1 - ndot) * inv_sigma_normal +
+                      std::abs(p.z[x] - q.z[x]) * depth_scale[x] * inv_dist +
+                      (dr * dr + dg * dg + db * db) * inv_sigma_color;
+            // zero normals (misses and the border) end up with
+            // a negligible weight without a branch
+            float w = k * fast_exp(-e);
+            sum_r[x] += w * q.r[x];
+            sum_g[x] += w * q.g[x];
+            sum_b[x] += w * q.b[x];
+            sum_w[x] += w;
+        }
+    }
+
+    // image and aovs hold sums over samples, the result is written back the same way
+    void apply(Image& image, const AOVs& aovs, int samples = 1) const {
+        // no iterations is no filtering, and no pad to size for it
+        if (iterations <= 0) return;
+        const int width = image.res.x, height = image.res.y;
+        const int pad = 2 << (iterations - 1);
+        const size_t stride = size_t(width) + 2 * pad;
+        const size_t plane = stride * height;
+        auto at = [&](int x, int y) { return size_t(y) * stride + pad + x; };
+
+        // color ping pong, normal, depth and the per pixel depth tolerance
+        std::vector<float> color[2][3], normal[3], depth(plane, 0), depth_scale(plane, 0);
+        std::vector<float> albedo[3];
+        for (int c = 0; c < 3; c++) {
+            color[0][c].assign(plane, 0);
+            color[1][c].assign(plane, 0);
+            normal[c].assign(plane, 0);
+            albedo[c].assign(size_t(width) * height, 1);
+        }
+
+        float inv_samples = 1.0f / samples;
+        parallel_for(
+            height,
+            [&](int begin, int end) {
+                for (int y = begin; y < end; y++) {
+                    for (int x = 0; x < width; x++) {
+                        size_t i = at(x, y), p = size_t(y) * width + x;
+                        const float* rgb = &image.pixel(x, y).x;
+                        const float* n = &aovs.normal.pixel(x, y).x;
+                        const float* a = &aovs.albedo.pixel(x, y).x;
+                        for (int c = 0; c < 3; c++) {
+                            // channels without albedo are filtered as is
+                            float alb = a[c] * inv_samples;
+                            albedo[c][p] = alb > 0.01f ? alb : 1;
+                            color[0][c][i] = rgb[c] * inv_samples / albedo[c][p];
+                            normal[c][i] = n[c] * inv_samples;
+                        }
+                        depth[i] = aovs.depth[p] * inv_samples;
+                    }
+                }
+            },
+            threads);
+        parallel_for(
+            height,
+            [&](int begin, int end) {
+                for (int y = begin; y < end; y++) {
+                    int y0 = std::max(y - 1, 0), y1 = std::min(y + 1, height - 1);
+                    for (int x = 0; x < width; x++) {
+                        int x0 = std::max(x - 1, 0), x1 = std::min(x + 1, width - 1);
+                        float z = depth[at(x, y)];
+                        float gx = std::abs(depth[at(x1, y)] - depth[at(x0, y)]) / (x1 - x0 + 1e-9f);
+                        float gy = std::abs(depth[at(x, y1)] - depth[at(x, y0)]) / (y1 - y0 + 1e-9f);
+                        float tolerance = sigma_depth * std::max(gx, gy) + 1e-3f * z + 1e-6f;
+                        depth_scale[at(x, y)] = 1 / tolerance;
+                    }
+                }
+            },
+            threads);
+
+        // b3 spline
+        const float kernel[5] = {1 / 16.0f, 1 / 4.0f, 3 / 8.0f, 1 / 4.0f, 1 / 16.0f};
+        const float inv_sigma_normal = 1 / sigma_normal;
+        int src = 0;
+        for (int it = 0; it < iterations; it++, src ^= 1) {
+            const int step = 1 << it;
+            const float sigma_c = sigma_color * std::pow(0.5f, it);
+            const float inv_sigma_color = 1 / (sigma_c * sigma_c);
+            const auto& in = color[src];
+            auto& out = color[src ^ 1];
+
+            parallel_for(
+                height,
+                [&](int begin, int end) {
+                    std::vector<float> sum_r(width), sum_g(width), sum_b(width), sum_w(width);
+                    for (int y = begin; y < end; y++) {
+                        const size_t row = at(0, y);
+                        const float *cr = &in[0][row], *cg = &in[1][row], *cb = &in[2][row];
+                        const float *nx = &normal[0][row], *ny = &normal[1][row],
+                                    *nz = &normal[2][row];
+                        const float *z = &depth[row], *zs = &depth_scale[row];
+
+                        const float center = kernel[2] * kernel[2];
+                        for (int x = 0; x < width; x++) {
+                            sum_r[x] = center * cr[x];
+                            sum_g[x] = center * cg[x];
+                            sum_b[x] = center * cb[x];
+                            sum_w[x] = center;
+                        }
+
+                        const RowPlanes p = {cr, cg, cb, nx, ny, nz, z};
+                        for (int ky = 0; ky < 5; ky++) {
+                            int yq = y + (ky - 2) * step;
+                            if (yq < 0 || yq >= height) continue;
+                            for (int kx = 0; kx < 5; kx++) {
+                                if (kx == 2 && ky == 2) continue;
+                                const size_t row_q = at(0, yq) + (kx - 2) * step;
+                                const RowPlanes q = {
+                                    &in[0][row_q],     &in[1][row_q],     &in[2][row_q],
+                                    &normal[0][row_q], &normal[1][row_q], &normal[2][row_q],
+                                    &depth[row_q],
+                                };
+                                float dist2 = float((kx - 2) * (kx - 2) + (ky - 2) * (ky - 2));
+                                accumulate_tap(width, kernel[kx] * kernel[ky],
+                                               1 / (step * std::sqrt(dist2)), inv_sigma_normal,
+                                               inv_sigma_color, p, zs, q, sum_r.data(),
+                                               sum_g.data(), sum_b.data(), sum_w.data());
+                            }
+                        }
+
+                        float *outr = &out[0][row], *outg = &out[1][row], *outb = &out[2][row];
+                        for (int x = 0; x < width; x++) {
+                            float inv = 1 / sum_w[x];
+                            outr[x] = sum_r[x] * inv;
+                            outg[x] = sum_g[x] * inv;
+                            outb[x] = sum_b[x] * inv;
+                        }
+                    }
+                },
+                threads);
+        }
+
+        // remodulate and scale back to sums
+        const auto& result = color[src];
+        parallel_for(
+            height,
+            [&](int begin, int end) {
+                for (int y = begin; y < end; y++) {
+                    for (int x = 0; x < width; x++) {
+                        size_t i = at(x, y), p = size_t(y) * width + x;
+                        float* rgb = &image.pixel(x, y).x;
+                        for (int c = 0; c < 3; c++)
+                            rgb[c] = result[c][i] * albedo[c][p] * samples;
+                    }
+                }
+            },
+            threads);
+    }
+};
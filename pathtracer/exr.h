@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "linalg.h"
+
+// float to ieee half, round to nearest even
+uint16_t float_to_half(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mant = x & 0x7fffff;
+    int exp = static_cast<int>((x >> 23) & 0xff);
+
+    if (exp == 255) return sign | 0x7c00 | (mant ? 0x200 : 0);  // inf or nan
+
+    int e = exp - 127 + 15;
+    if (e >= 31) return sign | 0x7c00;  // overflow to inf
+    if (e <= 0) {
+        // subnormal half
+        if (e < -10) return sign;
+        mant |= 0x800000;
+        int shift = 14 - e;
+        uint32_t ret = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (ret & 1))) ret++;
+        return sign | ret;
+    }
+
+    uint32_t ret = sign | (e << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (ret & 1))) ret++;  // carry into exponent is correct
+    return ret;
+}
+
+// minimal openexr writer: uncompressed scanlines of float, half or uint
+// channels, optional int attributes in the header (e.g. the sample count)
+// lines have to be written top to bottom, which is exr's y order
+struct ExrWriter {
+    enum PixelType {
+        UINT = 0,
+        HALF = 1,
+        FLOAT = 2,
+    };
+    struct Channel {
+        std::string name;
+        PixelType type;
+    };
+
+    std::ofstream out;
+    ivec2 res;
+    std::vector<Channel> channels;  // sorted by name, as exr requires
+    std::vector<int> order;         // channels[i] is the caller's channel order[i]
+    int next_line = 0;
+    std::streampos table_pos;
+    std::vector<uint64_t> offsets;
+    std::vector<char> line;
+    std::vector<float> rgb_planes;
+
+    ExrWriter() = default;
+
+    template <typename T>
+    void put(const T& value) {
+        // exr is little endian, same as every platform we build on
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+    void put_attribute(const std::string& name, const std::string& type, int size) {
+        out.write(name.c_str(), name.size() + 1);
+        out.write(type.c_str(), type.size() + 1);
+        put<int32_t>(size);
+    }
+    static size_t type_size(PixelType type) {
+        return type == HALF ? 2 : 4;
+    }
+
+    bool open(const std::string& filename, const ivec2& resolution,
+              const std::vector<Channel>& channel_list,
+              const std::vector<std::pair<std::string, int>>& int_attributes = {}) {
+        res = resolution;
+        next_line = 0;
+        order.resize(channel_list.size());
+        for (size_t i = 0; i < order.size(); i++) order[i] = i;
+        std::sort(order.begin(), order.end(),
+                  [&](int a, int b) { return channel_list[a].name < channel_list[b].name; });
+        channels.clear();
+        for (int i : order) channels.push_back(channel_list[i]);
+
+        out.open(filename, std::ios::binary);
+        if (!out) return false;
+
+        put<uint32_t>(20000630);  // magic
+        put<uint32_t>(2);         // version 2, scanline file
+
+        int chlist_size = 1;
+        for (const Channel& channel : channels) chlist_size += channel.name.size() + 1 + 16;
+        put_attribute("channels", "chlist", chlist_size);
+        for (const Channel& channel : channels) {
+            out.write(channel.name.c_str(), channel.name.size() + 1);
+            put<int32_t>(channel.type);
+            put<uint32_t>(0);  // pLinear and reserved
+            put<int32_t>(1);   // x sampling
+            put<int32_t>(1);   // y sampling
+        }
+        put<char>(0);
+
+        put_attribute("compression", "compression", 1);
+        put<char>(0);  // none
+        for (const char* window : {"dataWindow", "displayWindow"}) {
+            put_attribute(window, "box2i", 16);
+            put<int32_t>(0);
+            put<int32_t>(0);
+            put<int32_t>(res.x - 1);
+            put<int32_t>(res.y - 1);
+        }
+        put_attribute("lineOrder", "lineOrder", 1);
+        put<char>(0);  // increasing y
+        put_attribute("pixelAspectRatio", "float", 4);
+        put<float>(1);
+        put_attribute("screenWindowCenter", "v2f", 8);
+        put<float>(0);
+        put<float>(0);
+        put_attribute("screenWindowWidth", "float", 4);
+        put<float>(1);
+        for (const auto& [name, value] : int_attributes) {
+            put_attribute(name, "int", 4);
+            put<int32_t>(value);
+        }
+        put<char>(0);  // end of header
+
+        // offset table is filled in by close()
+        table_pos = out.tellp();
+        offsets.assign(res.y, 0);
+        out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+        size_t line_size = 0;
+        for (const Channel& channel : channels) line_size += res.x * type_size(channel.type);
+        line.resize(line_size);
+        return bool(out);
+    }
+    // rgb as float or half
+    bool open(const std::string& filename, const ivec2& resolution, bool half_float,
+              const std::vector<std::pair<std::string, int>>& int_attributes = {}) {
+        PixelType type = half_float ? HALF : FLOAT;
+        return open(filename, resolution, {{"R", type}, {"G", type}, {"B", type}},
+                    int_attributes);
+    }
+
+    // planes[i] holds res.x values of the i-th channel given to open for the next
+    // line down, float channels are multiplied by scale, uint channels are rounded
+    void write_line(const float* const* planes, float scale = 1) {
+        char* dst = line.data();
+        for (size_t c = 0; c < channels.size(); c++) {
+            const float* src = planes[order[c]];
+            for (int w = 0; w < res.x; w++) {
+                switch (channels[c].type) {
+                    case UINT: {
+                        uint32_t v = static_cast<uint32_t>(src[w] + 0.5f);
+                        std::memcpy(dst, &v, 4);
+                        break;
+                    }
+                    case HALF: {
+                        uint16_t v = float_to_half(src[w] * scale);
+                        std::memcpy(dst, &v, 2);
+                        break;
+                    }
+                    case FLOAT: {
+                        float v = src[w] * scale;
+                        std::memcpy(dst, &v, 4);
+                        break;
+                    }
+                }
+                dst += type_size(channels[c].type);
+            }
+        }
+        offsets[next_line] = static_cast<uint64_t>(out.tellp());
+        put<int32_t>(next_line++);
+        put<int32_t>(static_cast<int32_t>(line.size()));
+        out.write(line.data(), line.size());
+    }
+    // rgb holds res.x interleaved pixels, for files opened with the rgb open
+    void write_line(const float* rgb, float scale = 1) {
+        rgb_planes.resize(size_t(res.x) * 3);
+        float* r = rgb_planes.data();
+        float *g = r + res.x, *b = g + res.x;
+        for (int w = 0; w < res.x; w++) {
+            r[w] = rgb[w * 3];
+            g[w] = rgb[w * 3 + 1];
+            b[w] = rgb[w * 3 + 2];
+        }
+        const float* planes[3] = {r, g, b};
+        write_line(planes, scale);
+    }
+    bool close() {
+        if (next_line != res.y) return false;
+        out.seekp(table_pos);
+        out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+        out.close();
+        return !out.fail();
+    }
+};
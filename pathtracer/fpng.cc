@@ -23,6 +23,8 @@
 #include <assert.h>
 #include <string.h>
 
+#include <thread>
+
 #ifdef _MSC_VER
 #pragma warning(disable : 4127)  // conditional expression is constant
 #endif
@@ -55,6 +57,14 @@
 #include <stdio.h>
 #endif
 
+// pathtracer: only the SSE4.1/PCLMUL functions are compiled for that target, so the library
+// still runs on CPUs without it and picks the SIMD path at runtime through g_cpu_info.
+#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE && defined(__GNUC__)
+#define FPNG_SSE41_TARGET __attribute__((target("sse4.1,pclmul")))
+#else
+#define FPNG_SSE41_TARGET
+#endif
+
 // Allow the disabling of the chunk data CRC32 checks, for fuzz testing of the decoder
 #ifndef FPNG_DISABLE_DECODE_CRC32_CHECKS
 #define FPNG_DISABLE_DECODE_CRC32_CHECKS (0)
@@ -411,7 +421,7 @@ static uint32_t crc32_slice_by_4(const void* pData, size_t data_len, uint32_t cu
 // See Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction":
 // https://www.intel.com/content/dam/www/public/us/en/documents/white-papers/fast-crc-computation-generic-polynomials-pclmulqdq-paper.pdf
 // Requires PCLMUL and SSE 4.1. This function skips Step 1 (fold by 4) for simplicity/less code.
-static uint32_t crc32_pclmul(const uint8_t* p, size_t size, uint32_t crc) {
+FPNG_SSE41_TARGET static uint32_t crc32_pclmul(const uint8_t* p, size_t size, uint32_t crc) {
     assert(size >= 16);
 
     // See page 22 (bit reflected constants for gzip)
@@ -451,7 +461,7 @@ static uint32_t crc32_pclmul(const uint8_t* p, size_t size, uint32_t crc) {
         1);
 }
 
-static uint32_t crc32_sse41_simd(const unsigned char* buf, size_t len, uint32_t prev_crc32) {
+FPNG_SSE41_TARGET static uint32_t crc32_sse41_simd(const unsigned char* buf, size_t len, uint32_t prev_crc32) {
     if (len < 16) return crc32_slice_by_4(buf, len, prev_crc32);
 
     uint32_t simd_len = len & ~15;
@@ -555,6 +565,10 @@ cpu_info g_cpu_info;
 void fpng_init() {
     g_cpu_info.init();
 }
+
+// pathtracer: detect the CPU once at startup, after g_cpu_info is constructed in this
+// translation unit, so callers never hit the scalar path by forgetting fpng_init().
+static const bool g_cpu_info_initialized = (fpng_init(), true);
 #else
 void fpng_init() {}
 #endif
@@ -581,7 +595,7 @@ uint32_t fpng_crc32(const void* pData, size_t size, uint32_t prev_crc32) {
 // See "Fast Computation of Adler32 Checksums":
 // https://www.intel.com/content/www/us/en/developer/articles/technical/fast-computation-of-adler32-checksums.html
 // SSE 4.1, 16 bytes per iteration
-static uint32_t adler32_sse_16(const uint8_t* p, size_t len, uint32_t initial) {
+FPNG_SSE41_TARGET static uint32_t adler32_sse_16(const uint8_t* p, size_t len, uint32_t initial) {
     uint32_t s1 = initial & 0xFFFF, s2 = initial >> 16;
     const uint32_t K = 65521;
 
@@ -871,6 +885,9 @@ static const struct {
         }                                                   \
     } while (0)
 
+// pathtracer: which end of the stream a strip of scanlines covers
+enum { STRIP_FIRST = 1, STRIP_LAST = 2 };
+
 enum {
     DEFL_MAX_HUFF_TABLES = 3,
     DEFL_MAX_HUFF_SYMBOLS = 288,
@@ -1488,22 +1505,30 @@ static uint32_t pixel_deflate_dyn_3_rle(const uint8_t* pImg, uint32_t w, uint32_
     return dst_ofs;
 }
 
-static uint32_t pixel_deflate_dyn_3_rle_one_pass(const uint8_t* pImg, uint32_t w, uint32_t h,
-                                                 uint8_t* pDst, uint32_t dst_buf_size) {
+// pathtracer: encodes h filtered scanlines with the static one pass table. Only a STRIP_FIRST run
+// writes the zlib and block header and only a STRIP_LAST run ends the block, so consecutive runs
+// concatenated at total_bits granularity form the same stream as encoding all rows at once.
+static uint32_t pixel_deflate_dyn_3_rle_one_pass_rows(const uint8_t* pImg, uint32_t w, uint32_t h,
+                                                      uint32_t strip_flags, uint8_t* pDst,
+                                                      uint32_t dst_buf_size, uint64_t& total_bits) {
     const uint32_t bpl = 1 + w * 3;
 
-    if (dst_buf_size < sizeof(g_dyn_huff_3)) return false;
-    memcpy(pDst, g_dyn_huff_3, sizeof(g_dyn_huff_3));
-    uint32_t dst_ofs = sizeof(g_dyn_huff_3);
+    uint32_t dst_ofs = 0;
+    uint64_t bit_buf = 0;
+    int bit_buf_size = 0;
+
+    if (strip_flags & STRIP_FIRST) {
+        if (dst_buf_size < sizeof(g_dyn_huff_3)) return false;
+        memcpy(pDst, g_dyn_huff_3, sizeof(g_dyn_huff_3));
+        dst_ofs = sizeof(g_dyn_huff_3);
 
-    uint64_t bit_buf = DYN_HUFF_3_BITBUF;
-    int bit_buf_size = DYN_HUFF_3_BITBUF_SIZE;
+        bit_buf = DYN_HUFF_3_BITBUF;
+        bit_buf_size = DYN_HUFF_3_BITBUF_SIZE;
+    }
 
     const uint8_t* pSrc = pImg;
     uint32_t src_ofs = 0;
 
-    uint32_t src_adler32 = fpng_adler32(pImg, bpl * h, FPNG_ADLER32_INIT);
-
     for (uint32_t y = 0; y < h; y++) {
         const uint32_t end_src_ofs = src_ofs + bpl;
 
@@ -1575,10 +1600,27 @@ static uint32_t pixel_deflate_dyn_3_rle_one_pass(const uint8_t* pImg, uint32_t w
 
     assert(bit_buf_size <= 7);
 
-    PUT_BITS_CZ(g_dyn_huff_3_codes[256].m_code, g_dyn_huff_3_codes[256].m_code_size);
+    if (strip_flags & STRIP_LAST)
+        PUT_BITS_CZ(g_dyn_huff_3_codes[256].m_code, g_dyn_huff_3_codes[256].m_code_size);
+
+    total_bits = (uint64_t)dst_ofs * 8 + bit_buf_size;
 
     PUT_BITS_FORCE_FLUSH;
 
+    return dst_ofs;
+}
+
+static uint32_t pixel_deflate_dyn_3_rle_one_pass(const uint8_t* pImg, uint32_t w, uint32_t h,
+                                                 uint8_t* pDst, uint32_t dst_buf_size) {
+    const uint32_t bpl = 1 + w * 3;
+
+    uint64_t total_bits;
+    uint32_t dst_ofs = pixel_deflate_dyn_3_rle_one_pass_rows(
+        pImg, w, h, STRIP_FIRST | STRIP_LAST, pDst, dst_buf_size, total_bits);
+    if (!dst_ofs) return 0;
+
+    uint32_t src_adler32 = fpng_adler32(pImg, bpl * h, FPNG_ADLER32_INIT);
+
     // Write zlib adler32
     for (uint32_t i = 0; i < 4; i++) {
         if ((dst_ofs + 1) > dst_buf_size) return 0;
@@ -1758,22 +1800,30 @@ static uint32_t pixel_deflate_dyn_4_rle(const uint8_t* pImg, uint32_t w, uint32_
     return dst_ofs;
 }
 
-static uint32_t pixel_deflate_dyn_4_rle_one_pass(const uint8_t* pImg, uint32_t w, uint32_t h,
-                                                 uint8_t* pDst, uint32_t dst_buf_size) {
+// pathtracer: encodes h filtered scanlines with the static one pass table. Only a STRIP_FIRST run
+// writes the zlib and block header and only a STRIP_LAST run ends the block, so consecutive runs
+// concatenated at total_bits granularity form the same stream as encoding all rows at once.
+static uint32_t pixel_deflate_dyn_4_rle_one_pass_rows(const uint8_t* pImg, uint32_t w, uint32_t h,
+                                                      uint32_t strip_flags, uint8_t* pDst,
+                                                      uint32_t dst_buf_size, uint64_t& total_bits) {
     const uint32_t bpl = 1 + w * 4;
 
-    if (dst_buf_size < sizeof(g_dyn_huff_4)) return false;
-    memcpy(pDst, g_dyn_huff_4, sizeof(g_dyn_huff_4));
-    uint32_t dst_ofs = sizeof(g_dyn_huff_4);
+    uint32_t dst_ofs = 0;
+    uint64_t bit_buf = 0;
+    int bit_buf_size = 0;
 
-    uint64_t bit_buf = DYN_HUFF_4_BITBUF;
-    int bit_buf_size = DYN_HUFF_4_BITBUF_SIZE;
+    if (strip_flags & STRIP_FIRST) {
+        if (dst_buf_size < sizeof(g_dyn_huff_4)) return false;
+        memcpy(pDst, g_dyn_huff_4, sizeof(g_dyn_huff_4));
+        dst_ofs = sizeof(g_dyn_huff_4);
+
+        bit_buf = DYN_HUFF_4_BITBUF;
+        bit_buf_size = DYN_HUFF_4_BITBUF_SIZE;
+    }
 
     const uint8_t* pSrc = pImg;
     uint32_t src_ofs = 0;
 
-    uint32_t src_adler32 = fpng_adler32(pImg, bpl * h, FPNG_ADLER32_INIT);
-
     for (uint32_t y = 0; y < h; y++) {
         const uint32_t end_src_ofs = src_ofs + bpl;
 
@@ -1876,10 +1926,27 @@ static uint32_t pixel_deflate_dyn_4_rle_one_pass(const uint8_t* pImg, uint32_t w
 
     assert(bit_buf_size <= 7);
 
-    PUT_BITS_CZ(g_dyn_huff_4_codes[256].m_code, g_dyn_huff_4_codes[256].m_code_size);
+    if (strip_flags & STRIP_LAST)
+        PUT_BITS_CZ(g_dyn_huff_4_codes[256].m_code, g_dyn_huff_4_codes[256].m_code_size);
+
+    total_bits = (uint64_t)dst_ofs * 8 + bit_buf_size;
 
     PUT_BITS_FORCE_FLUSH;
 
+    return dst_ofs;
+}
+
+static uint32_t pixel_deflate_dyn_4_rle_one_pass(const uint8_t* pImg, uint32_t w, uint32_t h,
+                                                 uint8_t* pDst, uint32_t dst_buf_size) {
+    const uint32_t bpl = 1 + w * 4;
+
+    uint64_t total_bits;
+    uint32_t dst_ofs = pixel_deflate_dyn_4_rle_one_pass_rows(
+        pImg, w, h, STRIP_FIRST | STRIP_LAST, pDst, dst_buf_size, total_bits);
+    if (!dst_ofs) return 0;
+
+    uint32_t src_adler32 = fpng_adler32(pImg, bpl * h, FPNG_ADLER32_INIT);
+
     // Write zlib adler32
     for (uint32_t i = 0; i < 4; i++) {
         if ((dst_ofs + 1) > dst_buf_size) return 0;
@@ -1963,6 +2030,88 @@ static void apply_filter(uint32_t filter, int w, int h, uint32_t num_chans, uint
     }
 }
 
+// pathtracer: PNG signature, IHDR, fdEC chunk and the beginning of the IDAT chunk
+static const uint32_t PNG_HEADER_SIZE = 58;
+static void write_png_header(uint8_t* pDst, uint32_t w, uint32_t h, uint32_t num_chans,
+                             uint32_t idat_len) {
+    int i;
+    static const uint8_t s_color_type[] = {0x00, 0x00, 0x04, 0x02, 0x06};
+
+    uint8_t pnghdr[58] = {
+        0x89,
+        0x50,
+        0x4e,
+        0x47,
+        0x0d,
+        0x0a,
+        0x1a,
+        0x0a,  // PNG sig
+        0x00,
+        0x00,
+        0x00,
+        0x0d,
+        'I',
+        'H',
+        'D',
+        'R',  // IHDR chunk len, type
+        0,
+        0,
+        (uint8_t)(w >> 8),
+        (uint8_t)w,  // width
+        0,
+        0,
+        (uint8_t)(h >> 8),
+        (uint8_t)h,               // height
+        8,                        // bit_depth
+        s_color_type[num_chans],  // color_type
+        0,                        // compression
+        0,                        // filter
+        0,                        // interlace
+        0,
+        0,
+        0,
+        0,  // IHDR crc32
+        0,
+        0,
+        0,
+        5,
+        'f',
+        'd',
+        'E',
+        'C',
+        82,
+        36,
+        147,
+        227,
+        FPNG_FDEC_VERSION,
+        0xE5,
+        0xAB,
+        0x62,
+        0x99,  // our custom private, ancillary, do not copy, fdEC chunk
+        (uint8_t)(idat_len >> 24),
+        (uint8_t)(idat_len >> 16),
+        (uint8_t)(idat_len >> 8),
+        (uint8_t)idat_len,
+        'I',
+        'D',
+        'A',
+        'T'  // IDATA chunk len, type
+    };
+
+    // Compute IHDR CRC32
+    uint32_t c = (uint32_t)fpng_crc32(pnghdr + 12, 17, FPNG_CRC32_INIT);
+    for (i = 0; i < 4; ++i, c <<= 8) ((uint8_t*)(pnghdr + 29))[i] = (uint8_t)(c >> 24);
+
+    memcpy(pDst, pnghdr, PNG_HEADER_SIZE);
+}
+
+// pathtracer: IDAT chunk CRC32, followed by the IEND chunk
+static void write_png_trailer(std::vector<uint8_t>& out_buf, uint32_t idat_crc32) {
+    vector_append(out_buf, "\0\0\0\0\0\0\0\0\x49\x45\x4e\x44\xae\x42\x60\x82", 16);
+    for (int i = 0; i < 4; ++i, idat_crc32 <<= 8)
+        (out_buf.data() + out_buf.size() - 16)[i] = (uint8_t)(idat_crc32 >> 24);
+}
+
 bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans,
                                  std::vector<uint8_t>& out_buf, uint32_t flags) {
     if (!endian_check()) {
@@ -1981,7 +2130,7 @@ bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uin
         return false;
     }
 
-    int i, bpl = w * num_chans;
+    int bpl = w * num_chans;
     uint32_t y;
 
     std::vector<uint8_t> temp_buf;
@@ -1999,8 +2148,6 @@ bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uin
         temp_buf_ofs += 1 + bpl;
     }
 
-    const uint32_t PNG_HEADER_SIZE = 58;
-
     uint32_t out_ofs = PNG_HEADER_SIZE;
 
     out_buf.resize((out_ofs + (bpl + 1) * h + 7) & ~7);
@@ -2063,87 +2210,13 @@ bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uin
 
     const uint32_t idat_len = (uint32_t)out_buf.size() - PNG_HEADER_SIZE;
 
-    // Write real PNG header, fdEC chunk, and the beginning of the IDAT chunk
-    {
-        static const uint8_t s_color_type[] = {0x00, 0x00, 0x04, 0x02, 0x06};
-
-        uint8_t pnghdr[58] = {
-            0x89,
-            0x50,
-            0x4e,
-            0x47,
-            0x0d,
-            0x0a,
-            0x1a,
-            0x0a,  // PNG sig
-            0x00,
-            0x00,
-            0x00,
-            0x0d,
-            'I',
-            'H',
-            'D',
-            'R',  // IHDR chunk len, type
-            0,
-            0,
-            (uint8_t)(w >> 8),
-            (uint8_t)w,  // width
-            0,
-            0,
-            (uint8_t)(h >> 8),
-            (uint8_t)h,               // height
-            8,                        // bit_depth
-            s_color_type[num_chans],  // color_type
-            0,                        // compression
-            0,                        // filter
-            0,                        // interlace
-            0,
-            0,
-            0,
-            0,  // IHDR crc32
-            0,
-            0,
-            0,
-            5,
-            'f',
-            'd',
-            'E',
-            'C',
-            82,
-            36,
-            147,
-            227,
-            FPNG_FDEC_VERSION,
-            0xE5,
-            0xAB,
-            0x62,
-            0x99,  // our custom private, ancillary, do not copy, fdEC chunk
-            (uint8_t)(idat_len >> 24),
-            (uint8_t)(idat_len >> 16),
-            (uint8_t)(idat_len >> 8),
-            (uint8_t)idat_len,
-            'I',
-            'D',
-            'A',
-            'T'  // IDATA chunk len, type
-        };
-
-        // Compute IHDR CRC32
-        uint32_t c = (uint32_t)fpng_crc32(pnghdr + 12, 17, FPNG_CRC32_INIT);
-        for (i = 0; i < 4; ++i, c <<= 8) ((uint8_t*)(pnghdr + 29))[i] = (uint8_t)(c >> 24);
-
-        memcpy(out_buf.data(), pnghdr, PNG_HEADER_SIZE);
-    }
-
-    // Write IDAT chunk's CRC32 and a 0 length IEND chunk
-    vector_append(out_buf, "\0\0\0\0\0\0\0\0\x49\x45\x4e\x44\xae\x42\x60\x82",
-                  16);  // IDAT CRC32, followed by the IEND chunk
+    write_png_header(out_buf.data(), w, h, num_chans, idat_len);
 
     // Compute IDAT crc32
     uint32_t c =
         (uint32_t)fpng_crc32(out_buf.data() + PNG_HEADER_SIZE - 4, idat_len + 4, FPNG_CRC32_INIT);
 
-    for (i = 0; i < 4; ++i, c <<= 8) (out_buf.data() + out_buf.size() - 16)[i] = (uint8_t)(c >> 24);
+    write_png_trailer(out_buf, c);
 
     return true;
 }
@@ -2171,6 +2244,368 @@ bool fpng_encode_image_to_file(const char* pFilename, const void* pImage, uint32
 }
 #endif
 
+// pathtracer: strip parallel encoder.
+// Every strip of scanlines is filtered and entropy coded on its own thread with the static one
+// pass Huffman table. Matches never cross scanlines and the table never changes, so the strips
+// are slices of one dynamic deflate block: they are stitched together at bit granularity, and the
+// zlib Adler-32 and IDAT CRC-32 are combined from per strip checksums. The output is identical to
+// the single threaded encoder, so it stays readable by fpng_decode_memory and any PNG reader.
+
+static const uint32_t FPNG_MIN_STRIP_ROWS = 64;
+
+// From zlib: adler32 of A+B given adler32(A), adler32(B) and len(B)
+static uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, uint64_t len2) {
+    const uint32_t BASE = 65521;
+    uint32_t rem = (uint32_t)(len2 % BASE);
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % BASE);
+    sum1 += (adler2 & 0xFFFF) + BASE - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + BASE - rem;
+    if (sum1 >= BASE) sum1 -= BASE;
+    if (sum1 >= BASE) sum1 -= BASE;
+    if (sum2 >= (BASE << 1)) sum2 -= (BASE << 1);
+    if (sum2 >= BASE) sum2 -= BASE;
+    return sum1 | (sum2 << 16);
+}
+
+// From zlib: crc32 of A+B given crc32(A), crc32(B) and len(B), by applying len(B) zero bytes to
+// crc32(A) with GF(2) matrix squaring
+static uint32_t gf2_matrix_times(const uint32_t* pMat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, pMat++)
+        if (vec & 1) sum ^= *pMat;
+    return sum;
+}
+static void gf2_matrix_square(uint32_t* pSquare, const uint32_t* pMat) {
+    for (int n = 0; n < 32; n++) pSquare[n] = gf2_matrix_times(pMat, pMat[n]);
+}
+static uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    if (!len2) return crc1;
+
+    uint32_t even[32], odd[32];
+    odd[0] = 0xEDB88320;  // CRC-32 polynomial
+    for (uint32_t n = 1, row = 1; n < 32; n++, row <<= 1) odd[n] = row;
+
+    gf2_matrix_square(even, odd);  // 2 zero bits
+    gf2_matrix_square(odd, even);  // 4 zero bits
+
+    do {
+        gf2_matrix_square(even, odd);
+        if (len2 & 1) crc1 = gf2_matrix_times(even, crc1);
+        len2 >>= 1;
+        if (!len2) break;
+
+        gf2_matrix_square(odd, even);
+        if (len2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2);
+
+    return crc1 ^ crc2;
+}
+
+// Runs func(0) .. func(n - 1), each on its own thread
+template <typename F>
+static void run_threads(uint32_t n, const F& func) {
+    std::vector<std::thread> threads;
+    threads.reserve(n - 1);
+    for (uint32_t i = 1; i < n; i++) threads.emplace_back(func, i);
+    func(0);
+    for (std::thread& t : threads) t.join();
+}
+
+bool fpng_encode_image_to_memory_strips(const void* pImage, uint32_t w, uint32_t h,
+                                        uint32_t num_chans, std::vector<uint8_t>& out_buf,
+                                        uint32_t num_threads) {
+    if (!endian_check()) {
+        assert(0);
+        return false;
+    }
+
+    if ((w < 1) || (h < 1) || (w * (uint64_t)h > UINT32_MAX) || (w > FPNG_MAX_SUPPORTED_DIM) ||
+        (h > FPNG_MAX_SUPPORTED_DIM)) {
+        assert(0);
+        return false;
+    }
+
+    if ((num_chans != 3) && (num_chans != 4)) {
+        assert(0);
+        return false;
+    }
+
+    const uint32_t num_strips = minimum<uint32_t>(num_threads, h / FPNG_MIN_STRIP_ROWS);
+    if (num_strips <= 1) return fpng_encode_image_to_memory(pImage, w, h, num_chans, out_buf);
+
+    const uint32_t bpl = w * num_chans;
+
+    struct strip {
+        uint32_t y_start, y_end;
+        std::vector<uint8_t> filtered, deflated;
+        uint32_t filtered_len, deflated_len, adler32;
+        uint64_t bit_ofs, bits;
+        uint8_t first_byte;
+    };
+    std::vector<strip> strips(num_strips);
+
+    run_threads(num_strips, [&](uint32_t i) {
+        strip& s = strips[i];
+        s.y_start = (uint32_t)((uint64_t)h * i / num_strips);
+        s.y_end = (uint32_t)((uint64_t)h * (i + 1) / num_strips);
+        const uint32_t rows = s.y_end - s.y_start;
+
+        // +7 as the encoder reads whole 32-bit pixels
+        s.filtered_len = (bpl + 1) * rows;
+        s.filtered.resize(s.filtered_len + 7);
+        for (uint32_t y = s.y_start; y < s.y_end; y++) {
+            const uint8_t* pSrc = (const uint8_t*)pImage + (uint64_t)y * bpl;
+            const uint8_t* pPrev_src = y ? pSrc - bpl : nullptr;
+            apply_filter(y ? 2 : 0, w, h, num_chans, bpl, pSrc, pPrev_src,
+                         &s.filtered[(y - s.y_start) * (bpl + 1)]);
+        }
+        s.adler32 = fpng_adler32(s.filtered.data(), s.filtered_len, FPNG_ADLER32_INIT);
+
+        const uint32_t flags = (i == 0 ? STRIP_FIRST : 0) | (i == num_strips - 1 ? STRIP_LAST : 0);
+        s.deflated.resize(s.filtered_len + 128);
+        if (num_chans == 3)
+            s.deflated_len = pixel_deflate_dyn_3_rle_one_pass_rows(
+                s.filtered.data(), w, rows, flags, s.deflated.data(),
+                (uint32_t)s.deflated.size(), s.bits);
+        else
+            s.deflated_len = pixel_deflate_dyn_4_rle_one_pass_rows(
+                s.filtered.data(), w, rows, flags, s.deflated.data(),
+                (uint32_t)s.deflated.size(), s.bits);
+        s.filtered = std::vector<uint8_t>();
+    });
+
+    uint64_t total_bits = 0;
+    uint32_t adler32 = strips[0].adler32;
+    for (uint32_t i = 0; i < num_strips; i++) {
+        strip& s = strips[i];
+
+        // Didn't compress, let the single threaded encoder fall back to raw blocks
+        if (!s.deflated_len) return fpng_encode_image_to_memory(pImage, w, h, num_chans, out_buf);
+
+        s.bit_ofs = total_bits;
+        total_bits += s.bits;
+        if (i) adler32 = adler32_combine(adler32, s.adler32, s.filtered_len);
+    }
+
+    const uint64_t deflated_size = (total_bits + 7) / 8;
+    const uint64_t idat_len = deflated_size + 4;
+    if (PNG_HEADER_SIZE + idat_len + 16 > UINT32_MAX)
+        return fpng_encode_image_to_memory(pImage, w, h, num_chans, out_buf);
+
+    out_buf.assign(PNG_HEADER_SIZE + idat_len, 0);
+    uint8_t* pDeflate = out_buf.data() + PNG_HEADER_SIZE;
+
+    // Shift each strip into place. The first output byte of a strip may be shared with the end of
+    // the previous one, so it is kept aside and OR'd in after the threads are done.
+    run_threads(num_strips, [&](uint32_t i) {
+        strip& s = strips[i];
+        const uint32_t shift = (uint32_t)(s.bit_ofs & 7);
+        uint8_t* pDst = pDeflate + (s.bit_ofs >> 3);
+        const uint8_t* pSrc = s.deflated.data();
+        const uint64_t src_len = (s.bits + 7) / 8, dst_len = (shift + s.bits + 7) / 8;
+
+        for (uint64_t k = 0; k < dst_len; k++) {
+            uint32_t cur = k < src_len ? pSrc[k] : 0;
+            uint32_t prev = k ? pSrc[k - 1] : 0;
+            uint8_t b = (uint8_t)(shift ? ((cur << shift) | (prev >> (8 - shift))) : cur);
+            if (k)
+                pDst[k] = b;
+            else
+                s.first_byte = b;
+        }
+        s.deflated = std::vector<uint8_t>();
+    });
+    for (const strip& s : strips) pDeflate[s.bit_ofs >> 3] |= s.first_byte;
+
+    // Write zlib adler32
+    for (uint32_t i = 0; i < 4; i++, adler32 <<= 8)
+        pDeflate[deflated_size + i] = (uint8_t)(adler32 >> 24);
+
+    write_png_header(out_buf.data(), w, h, num_chans, (uint32_t)idat_len);
+
+    // IDAT crc32 covers the chunk type and data, computed in chunks and combined
+    const uint8_t* pCrc = out_buf.data() + PNG_HEADER_SIZE - 4;
+    const uint64_t crc_len = idat_len + 4;
+    std::vector<uint32_t> crcs(num_strips);
+    run_threads(num_strips, [&](uint32_t i) {
+        uint64_t start = crc_len * i / num_strips, end = crc_len * (i + 1) / num_strips;
+        crcs[i] = fpng_crc32(pCrc + start, end - start, FPNG_CRC32_INIT);
+    });
+    uint32_t crc32 = crcs[0];
+    for (uint32_t i = 1; i < num_strips; i++) {
+        uint64_t start = crc_len * i / num_strips, end = crc_len * (i + 1) / num_strips;
+        crc32 = crc32_combine(crc32, crcs[i], end - start);
+    }
+
+    write_png_trailer(out_buf, crc32);
+
+    return true;
+}
+
+#ifndef FPNG_NO_STDIO
+bool fpng_encode_image_to_file_strips(const char* pFilename, const void* pImage, uint32_t w,
+                                      uint32_t h, uint32_t num_chans, uint32_t num_threads) {
+    std::vector<uint8_t> out_buf;
+    if (!fpng_encode_image_to_memory_strips(pImage, w, h, num_chans, out_buf, num_threads))
+        return false;
+
+    FILE* pFile = nullptr;
+#ifdef _MSC_VER
+    fopen_s(&pFile, pFilename, "wb");
+#else
+    pFile = fopen(pFilename, "wb");
+#endif
+    if (!pFile) return false;
+
+    if (fwrite(out_buf.data(), 1, out_buf.size(), pFile) != out_buf.size()) {
+        fclose(pFile);
+        return false;
+    }
+
+    return (fclose(pFile) != EOF);
+}
+#endif
+
+#ifndef FPNG_NO_STDIO
+static void write_be32(uint8_t* pDst, uint32_t v) {
+    pDst[0] = (uint8_t)(v >> 24);
+    pDst[1] = (uint8_t)(v >> 16);
+    pDst[2] = (uint8_t)(v >> 8);
+    pDst[3] = (uint8_t)v;
+}
+
+fpng_stream_writer::~fpng_stream_writer() {
+    if (m_pFile) fclose(m_pFile);
+}
+
+bool fpng_stream_writer::write_chunk(const char* pType, const uint8_t* pData, size_t size) {
+    if (size > 0x7FFFFFFF) return false;
+
+    uint8_t hdr[8];
+    write_be32(hdr, (uint32_t)size);
+    memcpy(hdr + 4, pType, 4);
+    uint8_t crc[4];
+    write_be32(crc, fpng_crc32(pData, size, fpng_crc32(hdr + 4, 4, FPNG_CRC32_INIT)));
+
+    return (fwrite(hdr, 1, 8, m_pFile) == 8) && (fwrite(pData, 1, size, m_pFile) == size) &&
+           (fwrite(crc, 1, 4, m_pFile) == 4);
+}
+
+bool fpng_stream_writer::open(const char* pFilename, uint32_t w, uint32_t h, uint32_t num_chans) {
+    if (!endian_check()) {
+        assert(0);
+        return false;
+    }
+
+    // PNG itself allows 2^31-1, fpng's one pass encoder handles any row length
+    if ((w < 1) || (h < 1) || (w > 0x7FFFFFFF) || (h > 0x7FFFFFFF) ||
+        ((num_chans != 3) && (num_chans != 4)))
+        return false;
+
+    if (m_pFile) fclose(m_pFile);
+#ifdef _MSC_VER
+    fopen_s(&m_pFile, pFilename, "wb");
+#else
+    m_pFile = fopen(pFilename, "wb");
+#endif
+    if (!m_pFile) return false;
+
+    m_w = w;
+    m_h = h;
+    m_num_chans = num_chans;
+    m_rows_done = 0;
+    m_adler32 = FPNG_ADLER32_INIT;
+    m_pending_byte = 0;
+    m_pending_bits = 0;
+    m_prev_row.assign((size_t)w * num_chans, 0);
+
+    static const uint8_t s_sig[8] = {0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a};
+    uint8_t ihdr[13];
+    write_be32(ihdr, w);
+    write_be32(ihdr + 4, h);
+    ihdr[8] = 8;                            // bit depth
+    ihdr[9] = (num_chans == 3) ? 2 : 6;     // color type
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;     // compression, filter, interlace
+
+    return (fwrite(s_sig, 1, 8, m_pFile) == 8) && write_chunk("IHDR", ihdr, sizeof(ihdr));
+}
+
+bool fpng_stream_writer::add_rows(const void* pRows, uint32_t num_rows) {
+    if (!m_pFile || !num_rows || (num_rows > m_h - m_rows_done)) return false;
+
+    const uint32_t bpl = m_w * m_num_chans;
+    const uint64_t filtered_len = (uint64_t)(bpl + 1) * num_rows;
+    // the one pass encoder takes 32-bit sizes, and can expand incompressible data
+    if (filtered_len * 2 + 128 > UINT32_MAX) return false;
+
+    // +7 as the encoder reads whole 32-bit pixels
+    m_filtered.resize((size_t)filtered_len + 7);
+    for (uint32_t y = 0; y < num_rows; y++) {
+        const uint8_t* pSrc = (const uint8_t*)pRows + (uint64_t)y * bpl;
+        const uint8_t* pPrev_src = y ? pSrc - bpl : m_prev_row.data();
+        apply_filter((m_rows_done + y) ? 2 : 0, m_w, m_h, m_num_chans, bpl, pSrc, pPrev_src,
+                     &m_filtered[(size_t)y * (bpl + 1)]);
+    }
+    memcpy(m_prev_row.data(), (const uint8_t*)pRows + (uint64_t)(num_rows - 1) * bpl, bpl);
+    m_adler32 = fpng_adler32(m_filtered.data(), (size_t)filtered_len, m_adler32);
+
+    const bool last = (m_rows_done + num_rows == m_h);
+    const uint32_t flags = (m_rows_done ? 0 : STRIP_FIRST) | (last ? STRIP_LAST : 0);
+    m_deflated.resize((size_t)filtered_len * 2 + 128);
+    uint64_t bits = 0;
+    uint32_t deflated_len;
+    if (m_num_chans == 3)
+        deflated_len = pixel_deflate_dyn_3_rle_one_pass_rows(m_filtered.data(), m_w, num_rows,
+                                                             flags, m_deflated.data(),
+                                                             (uint32_t)m_deflated.size(), bits);
+    else
+        deflated_len = pixel_deflate_dyn_4_rle_one_pass_rows(m_filtered.data(), m_w, num_rows,
+                                                             flags, m_deflated.data(),
+                                                             (uint32_t)m_deflated.size(), bits);
+    if (!deflated_len) return false;
+    m_rows_done += num_rows;
+
+    // shift the new bits in after the pending ones
+    const uint32_t shift = m_pending_bits;
+    const uint64_t total_bits = shift + bits;
+    const size_t src_len = (size_t)((bits + 7) / 8);
+    m_chunk.assign((size_t)((total_bits + 7) / 8) + (last ? 4 : 0), 0);
+    m_chunk[0] = m_pending_byte;
+    for (size_t k = 0; k < src_len; k++) {
+        uint32_t v = (uint32_t)m_deflated[k] << shift;
+        m_chunk[k] |= (uint8_t)v;
+        if (shift && (k + 1 < m_chunk.size())) m_chunk[k + 1] |= (uint8_t)(v >> 8);
+    }
+
+    size_t chunk_len;
+    if (last) {
+        // flush everything and end with the zlib adler32
+        chunk_len = m_chunk.size();
+        write_be32(&m_chunk[chunk_len - 4], m_adler32);
+    } else {
+        chunk_len = (size_t)(total_bits / 8);
+        m_pending_bits = (uint32_t)(total_bits & 7);
+        m_pending_byte = m_pending_bits ? m_chunk[chunk_len] : 0;
+    }
+
+    return !chunk_len || write_chunk("IDAT", m_chunk.data(), chunk_len);
+}
+
+bool fpng_stream_writer::close() {
+    if (!m_pFile) return false;
+
+    bool success = (m_rows_done == m_h) && write_chunk("IEND", nullptr, 0);
+    success = (fclose(m_pFile) != EOF) && success;
+    m_pFile = nullptr;
+    m_filtered = std::vector<uint8_t>();
+    m_deflated = std::vector<uint8_t>();
+    m_chunk = std::vector<uint8_t>();
+    return success;
+}
+#endif
+
 // Decompression
 
 const uint32_t FPNG_DECODER_TABLE_BITS = 12;
@@ -2,6 +2,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <vector>
@@ -55,6 +56,45 @@ bool fpng_encode_image_to_file(const char* pFilename, const void* pImage, uint32
                                uint32_t num_chans, uint32_t flags = 0);
 #endif
 
+// pathtracer: multithreaded variants of the above. The image is split into horizontal strips that
+// are compressed concurrently, then stitched into the same stream the single threaded encoder
+// produces. Uses the default (fast) mode, small images are encoded on the calling thread.
+bool fpng_encode_image_to_memory_strips(const void* pImage, uint32_t w, uint32_t h,
+                                        uint32_t num_chans, std::vector<uint8_t>& out_buf,
+                                        uint32_t num_threads);
+#ifndef FPNG_NO_STDIO
+bool fpng_encode_image_to_file_strips(const char* pFilename, const void* pImage, uint32_t w,
+                                      uint32_t h, uint32_t num_chans, uint32_t num_threads);
+
+// pathtracer: scanline streaming encoder for images too large to hold in memory. Rows are added
+// top to bottom in batches of any size, each batch is compressed into its own IDAT chunk and
+// written out straight away, so only one batch and one previous row are kept. Uses the same
+// static Huffman table as the fast mode, the file is a regular PNG (without the fdEC marker).
+class fpng_stream_writer {
+   public:
+    fpng_stream_writer() = default;
+    ~fpng_stream_writer();
+    fpng_stream_writer(const fpng_stream_writer&) = delete;
+    fpng_stream_writer& operator=(const fpng_stream_writer&) = delete;
+
+    bool open(const char* pFilename, uint32_t w, uint32_t h, uint32_t num_chans);
+    // pRows holds num_rows rows with a pitch of w * num_chans bytes
+    bool add_rows(const void* pRows, uint32_t num_rows);
+    // fails if fewer than h rows were added
+    bool close();
+
+   private:
+    bool write_chunk(const char* pType, const uint8_t* pData, size_t size);
+
+    FILE* m_pFile = nullptr;
+    uint32_t m_w = 0, m_h = 0, m_num_chans = 0, m_rows_done = 0;
+    uint32_t m_adler32 = FPNG_ADLER32_INIT;
+    std::vector<uint8_t> m_prev_row, m_filtered, m_deflated, m_chunk;
+    uint8_t m_pending_byte = 0;  // deflate bits that don't fill a byte yet
+    uint32_t m_pending_bits = 0;
+};
+#endif
+
 // ---- Decompression
 
 enum {
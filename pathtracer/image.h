@@ -1,75 +1,198 @@
 #pragma once
 
-#include "fstream"
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <new>
+#include <vector>
 
+#include "exr.h"
 #include "fpng.h"
 #include "linalg.h"
+#include "postprocess.h"
+
+#define IMAGE_ALIGNMENT 64
+
+// cache line aligned allocator so whole image loops
+// start on a vector boundary
+template <typename T>
+struct AlignedAllocator {
+    using value_type = T;
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        // aligned_alloc requires the size to be a multiple of the alignment
+        size_t bytes = (n * sizeof(T) + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+        void* ptr = std::aligned_alloc(IMAGE_ALIGNMENT, bytes);
+        if (!ptr) throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+    void deallocate(T* ptr, size_t) {
+        std::free(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U>&) const {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U>&) const {
+        return false;
+    }
+};
+
+bool ends_with(const std::string& str, const std::string& suffix) {
+    return str.size() >= suffix.size() &&
+           str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+// file written next to an image, with the image's extension replaced by suffix
+std::string sidecar_filename(const std::string& filename, const std::string& suffix) {
+    size_t dot = filename.find_last_of('.');
+    size_t slash = filename.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return filename + suffix;
+    return filename.substr(0, dot) + suffix;
+}
+
+static_assert(sizeof(vec3) == 3 * sizeof(float), "vec3 must be tightly packed");
 
 struct Image {
     ivec2 res;
-    std::vector<std::vector<vec3>> pixels;
+    // row major, row 0 is the bottom of the image
+    std::vector<vec3, AlignedAllocator<vec3>> pixels;
 
     Image() = default;
     Image(const ivec2& resolution)
-        : res(resolution), pixels(resolution.y, std::vector<vec3>(resolution.x)) {}
+        : res(resolution), pixels(size_t(resolution.x) * resolution.y, vec3(0)) {}
+
+    // unchecked access for the render loops
+    vec3& pixel(int w, int h) {
+        return pixels[size_t(h) * res.x + w];
+    }
+    const vec3& pixel(int w, int h) const {
+        return pixels[size_t(h) * res.x + w];
+    }
+    // flat view of the channels, 3 floats per pixel
+    float* data() {
+        return reinterpret_cast<float*>(pixels.data());
+    }
+    const float* data() const {
+        return reinterpret_cast<const float*>(pixels.data());
+    }
+    size_t channels() const {
+        return pixels.size() * 3;
+    }
 
+    // checked access
     void set_pixel(int w, int h, const vec3& color) {
         if (w < 0 || w >= res.x || h < 0 || h >= res.y)
             throw std::out_of_range("pixel out of range");
-        pixels[h][w] = color;
+        pixel(w, h) = color;
     }
     vec3 get_pixel(int w, int h) const {
         if (w < 0 || w >= res.x || h < 0 || h >= res.y)
             throw std::out_of_range("pixel out of range");
-        return pixels[h][w];
+        return pixel(w, h);
     }
     vec3& get_pixel(int w, int h) {
         if (w < 0 || w >= res.x || h < 0 || h >= res.y)
             throw std::out_of_range("pixel out of range");
-        return pixels[h][w];
+        return pixel(w, h);
     }
+
     void operator+=(const Image& other) {
         if (res != other.res) throw std::invalid_argument("image resolution mismatch");
-        for (int h = 0; h < res.y; h++)
-            for (int w = 0; w < res.x; w++) pixels[h][w] += other.pixels[h][w];
+        float* dst = data();
+        const float* src = other.data();
+        for (size_t i = 0, n = channels(); i < n; i++) dst[i] += src[i];
     }
     void operator/=(float scalar) {
-        for (int h = 0; h < res.y; h++)
-            for (int w = 0; w < res.x; w++) pixels[h][w] /= scalar;
+        float* dst = data();
+        float inv = 1 / scalar;
+        for (size_t i = 0, n = channels(); i < n; i++) dst[i] *= inv;
     }
     void gamma_correct(float gamma) {
-        for (int h = 0; h < res.y; h++)
-            for (int w = 0; w < res.x; w++) pixels[h][w] = pow(pixels[h][w], 1 / gamma);
-    }
-    void save_png(std::string filename) {
-        std::vector<unsigned char> data(res.x * res.y * 3);
-        for (int h = 0; h < res.y; h++) {
-            for (int w = 0; w < res.x; w++) {
-                int index = (h * res.x + w) * 3;
-                data[index + 0] =
-                    static_cast<unsigned char>(clamp(pixels[res.y - h - 1][w].x, 0, 1) * 255);
-                data[index + 1] =
-                    static_cast<unsigned char>(clamp(pixels[res.y - h - 1][w].y, 0, 1) * 255);
-                data[index + 2] =
-                    static_cast<unsigned char>(clamp(pixels[res.y - h - 1][w].z, 0, 1) * 255);
-            }
-        }
-
-        bool success =
-            fpng::fpng_encode_image_to_file(filename.c_str(), data.data(), res.x, res.y, 3);
+        float* dst = data();
+        float inv = 1 / gamma;
+        for (size_t i = 0, n = channels(); i < n; i++) dst[i] = std::pow(dst[i], inv);
+    }
+    std::vector<unsigned char> to_rgb8(const PostProcess& post) const {
+        std::vector<unsigned char> ret(channels());
+        post.apply(data(), res, ret.data());
+        return ret;
+    }
+    std::vector<unsigned char> to_rgb8() const {
+        // values are already display ready, only clamp and quantize
+        return to_rgb8(PostProcess(1, 1));
+    }
+    bool save_png(std::string filename, const PostProcess& post) const {
+        std::vector<unsigned char> data = to_rgb8(post);
+        bool success = fpng::fpng_encode_image_to_file_strips(filename.c_str(), data.data(), res.x,
+                                                              res.y, 3, thread_count(post.threads));
         if (!success) std::cerr << "Failed to write image to file: " << filename << '\n';
+        return success;
     }
-    void save_ppm(std::string filename) {
-        std::ofstream out(filename);
+    bool save_png(std::string filename) const {
+        return save_png(filename, PostProcess(1, 1));
+    }
+    bool save_ppm(std::string filename, const PostProcess& post) const {
+        std::vector<unsigned char> data = to_rgb8(post);
+        std::ofstream out(filename, std::ios::binary);
         out << "P6\n" << res.x << " " << res.y << "\n255\n";
-        for (int h = 0; h < res.y; h++) {
-            for (int w = 0; w < res.x; w++) {
-                out << static_cast<unsigned char>(clamp(pixels[res.y - h - 1][w].x, 0, 1) * 255);
-                out << static_cast<unsigned char>(clamp(pixels[res.y - h - 1][w].y, 0, 1) * 255);
-                out << static_cast<unsigned char>(clamp(pixels[res.y - h - 1][w].z, 0, 1) * 255);
+        out.write(reinterpret_cast<const char*>(data.data()), data.size());
+        out.close();
+        if (out.fail()) std::cerr << "Failed to write image to file: " << filename << '\n';
+        return !out.fail();
+    }
+    bool save_ppm(std::string filename) const {
+        return save_ppm(filename, PostProcess(1, 1));
+    }
+
+    // lossless linear output, pixels are scaled by 1 / samples
+    // so the file holds the mean radiance of each pixel
+    bool save_pfm(std::string filename, int samples = 1) const {
+        std::ofstream out(filename, std::ios::binary);
+        // negative scale marks little endian, rows are stored bottom to top like ours
+        out << "PF\n" << res.x << " " << res.y << "\n-1.0\n";
+        if (samples == 1) {
+            out.write(reinterpret_cast<const char*>(data()), channels() * sizeof(float));
+        } else {
+            std::vector<float> row(size_t(res.x) * 3);
+            float inv = 1.0f / samples;
+            for (int h = 0; h < res.y; h++) {
+                const float* src = &pixel(0, h).x;
+                for (size_t i = 0; i < row.size(); i++) row[i] = src[i] * inv;
+                out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
             }
         }
         out.close();
+        if (out.fail()) std::cerr << "Failed to write image to file: " << filename << '\n';
+        return !out.fail();
+    }
+    // openexr with the sample count stored as an int attribute "samples"
+    bool save_exr(std::string filename, int samples = 1, bool half = false) const {
+        ExrWriter exr;
+        bool success = exr.open(filename, res, half, {{"samples", samples}});
+        // exr lines go top to bottom
+        for (int h = res.y - 1; success && h >= 0; h--)
+            exr.write_line(&pixel(0, h).x, 1.0f / samples);
+        success = success && exr.close();
+        if (!success) std::cerr << "Failed to write image to file: " << filename << '\n';
+        return success;
+    }
+    // pick the format from the extension, post is only used for 8 bit formats
+    bool save(std::string filename, int samples = 1, PostProcess post = PostProcess(1)) const {
+        post.scale /= samples;
+        if (ends_with(filename, ".exr"))
+            return save_exr(filename, samples);
+        else if (ends_with(filename, ".pfm"))
+            return save_pfm(filename, samples);
+        else if (ends_with(filename, ".ppm"))
+            return save_ppm(filename, post);
+        else
+            return save_png(filename, post);
     }
-};
\ No newline at end of file
+};
@@ -3,15 +3,19 @@
 #include "linalg.h"
 #include "rng.h"
 
-vec3 hemisphere_sample(const vec3 &ray_d, const vec3 &normal) {
-    // random hemisphere sample
-    float u = rng.rand01(), v = rng.rand01();
+vec3 hemisphere_sample(const vec3 &ray_d, const vec3 &normal, float u, float v) {
+    // hemisphere sample from u, v in [0, 1)
     float theta = std::acos(2 * u - 1) - M_PI_2;
     float phi = 2 * M_PI * v;
     vec3 sample = {std::cos(theta) * std::cos(phi), std::cos(theta) * std::sin(phi),
                     std::sin(theta)};
     return sample.dot(normal) < 0 ? -sample : sample;
 }
+vec3 hemisphere_sample(const vec3 &ray_d, const vec3 &normal) {
+    // random hemisphere sample
+    float u = rng.rand01(), v = rng.rand01();
+    return hemisphere_sample(ray_d, normal, u, v);
+}
 vec3 specular_sample(const vec3 &ray_d, const vec3 &normal, float roughness) {
     vec3 reflected = ray_d - 2 * ray_d.dot(normal) * normal;
 
@@ -38,15 +42,21 @@ struct Material {
     Material(Type type, const vec3& color, const vec3& emit_color, float roughness)
         : type(type), color(color), emit_color(emit_color), roughness(roughness) {}
     vec3 reflected_dir(const vec3& ray_d, const vec3& normal) const {
+        float u = rng.rand01(), v = rng.rand01();
+        return reflected_dir(ray_d, normal, vec2(u, v));
+    }
+    vec3 reflected_dir(const vec3& ray_d, const vec3& normal, const vec2& sample) const {
+        // sample drives the diffuse lobe, specular still
+        // needs the rng for its rejection sampling
         switch (type) {
             case DIFFUSE:
-                return hemisphere_sample(ray_d, normal);
+                return hemisphere_sample(ray_d, normal, sample.x, sample.y);
             case EMIT:
                 return {0, 0, 0};
             case SPECULAR:
                 return specular_sample(ray_d, normal, roughness);
             default:
-                return hemisphere_sample(ray_d, normal);
+                return hemisphere_sample(ray_d, normal, sample.x, sample.y);
         }
     }
 };
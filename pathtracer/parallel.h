@@ -0,0 +1,32 @@
+#pragma once
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+int thread_count(int threads = 0) {
+    // 0 means every hardware thread
+    if (threads > 0) return threads;
+    int hardware = std::thread::hardware_concurrency();
+    return hardware > 0 ? hardware : 1;
+}
+
+// splits [0, count) into contiguous ranges and calls fn(begin, end)
+// once per range, each on its own thread (the caller runs the first one)
+template <typename F>
+void parallel_for(int count, const F& fn, int threads = 0) {
+    int n = std::min(thread_count(threads), count);
+    if (n <= 1) {
+        if (count > 0) fn(0, count);
+        return;
+    }
+
+    auto range_start = [&](int i) {
+        return static_cast<int>(static_cast<long long>(count) * i / n);
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(n - 1);
+    for (int i = 1; i < n; i++) workers.emplace_back(fn, range_start(i), range_start(i + 1));
+    fn(0, range_start(1));
+    for (std::thread& worker : workers) worker.join();
+}
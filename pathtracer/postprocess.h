@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "linalg.h"
+#include "parallel.h"
+
+#define POSTPROCESS_LUT_SIZE 65536
+#define POSTPROCESS_BLOCK 256
+
+// fused display transform from a linear float framebuffer to 8 bit rgb:
+// scale (e.g. 1 / spp) and exposure, tonemap, transfer curve and
+// quantization in a single multithreaded pass over the image
+struct PostProcess {
+    enum Tonemap {
+        CLAMP,
+        REINHARD,
+        ACES,  // narkowicz's fit of the aces filmic curve
+    };
+    enum Transfer {
+        GAMMA,
+        SRGB,
+    };
+
+    float scale = 1;
+    float exposure = 0;  // in stops
+    Tonemap tonemap = CLAMP;
+    Transfer transfer = GAMMA;
+    float gamma = 2.2;
+    bool flip = true;  // output rows top to bottom
+    int threads = 0;   // 0 uses every hardware thread
+
+    PostProcess() = default;
+    PostProcess(float scale, float gamma = 2.2) : scale(scale), gamma(gamma) {}
+
+    std::vector<unsigned char> build_lut() const {
+        // maps tonemapped values in [0, 1] to 8 bit display values
+        std::vector<unsigned char> lut(POSTPROCESS_LUT_SIZE);
+        for (int i = 0; i < POSTPROCESS_LUT_SIZE; i++) {
+            float x = static_cast<float>(i) / (POSTPROCESS_LUT_SIZE - 1);
+            float y;
+            if (transfer == SRGB)
+                y = x <= 0.0031308f ? 12.92f * x : 1.055f * std::pow(x, 1 / 2.4f) - 0.055f;
+            else
+                y = std::pow(x, 1 / gamma);
+            lut[i] = static_cast<unsigned char>(clamp(y, 0, 1) * 255);
+        }
+        return lut;
+    }
+
+    template <Tonemap op>
+    static float tonemap_op(float x) {
+        if (op == REINHARD) return x / (1 + x);
+        if (op == ACES) return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+        return x;
+    }
+    template <Tonemap op>
+    static void apply_row(const float* in, unsigned char* out, size_t n, float k,
+                          const unsigned char* lut) {
+        // the lut index math is branch free so it vectorizes,
+        // only the lookup itself is a scalar gather
+        uint32_t idx[POSTPROCESS_BLOCK];
+        for (size_t start = 0; start < n; start += POSTPROCESS_BLOCK) {
+            size_t len = std::min<size_t>(POSTPROCESS_BLOCK, n - start);
+            for (size_t i = 0; i < len; i++) {
+                float v = tonemap_op<op>(in[start + i] * k);
+                v = v > 0 ? (v < 1 ? v : 1) : 0;  // also maps nan to 0
+                idx[i] = static_cast<uint32_t>(v * (POSTPROCESS_LUT_SIZE - 1) + 0.5f);
+            }
+            for (size_t i = 0; i < len; i++) out[start + i] = lut[idx[i]];
+        }
+    }
+
+    // src is res.x * res.y rgb floats with row 0 at the bottom,
+    // dst must hold res.x * res.y * 3 bytes
+    void apply(const float* src, const ivec2& res, unsigned char* dst) const {
+        std::vector<unsigned char> lut = build_lut();
+        float k = scale * std::exp2(exposure);
+        size_t row = size_t(res.x) * 3;
+
+        parallel_for(
+            res.y,
+            [&](int begin, int end) {
+                for (int h = begin; h < end; h++) {
+                    const float* in = src + (flip ? res.y - h - 1 : h) * row;
+                    unsigned char* out = dst + h * row;
+                    switch (tonemap) {
+                        case REINHARD:
+                            apply_row<REINHARD>(in, out, row, k, lut.data());
+                            break;
+                        case ACES:
+                            apply_row<ACES>(in, out, row, k, lut.data());
+                            break;
+                        default:
+                            apply_row<CLAMP>(in, out, row, k, lut.data());
+                            break;
+                    }
+                }
+            },
+            threads);
+    }
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define PROGRAM_CACHE_MAGIC 0x43505450u  // "PTPC"
+
+// one stage of a program, source is everything that goes to glShaderSource
+struct ShaderStage {
+    GLenum type;
+    std::string source;
+};
+
+// where program binaries are kept: $PATHTRACER_SHADER_CACHE, else
+// $XDG_CACHE_HOME/pathtracer, else ~/.cache/pathtracer
+// an empty PATHTRACER_SHADER_CACHE turns the cache off
+std::string program_cache_dir() {
+    if (const char* dir = std::getenv("PATHTRACER_SHADER_CACHE")) return dir;
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME")) return std::string(xdg) + "/pathtracer";
+    if (const char* home = std::getenv("HOME")) return std::string(home) + "/.cache/pathtracer";
+    return "";
+}
+
+// fnv-1a over the driver strings and every stage, a driver
+// update or a change to any source gives a different key
+uint64_t program_key(const std::vector<ShaderStage>& stages) {
+    uint64_t value = 1469598103934665603ull;
+    auto add = [&](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            value ^= bytes[i];
+            value *= 1099511628211ull;
+        }
+    };
+    for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+        const char* str = reinterpret_cast<const char*>(glGetString(name));
+        if (str) add(str, std::strlen(str) + 1);
+    }
+    for (const ShaderStage& stage : stages) {
+        add(&stage.type, sizeof(stage.type));
+        add(stage.source.data(), stage.source.size() + 1);
+    }
+    return value;
+}
+
+GLuint compile_program(const std::vector<ShaderStage>& stages, bool retrievable = false) {
+    // 0 if any stage fails, with the driver's log on stderr
+    GLuint program = glCreateProgram();
+    std::vector<GLuint> shaders;
+    bool success = true;
+    for (const ShaderStage& stage : stages) {
+        GLuint shader = glCreateShader(stage.type);
+        const char* source = stage.source.c_str();
+        glShaderSource(shader, 1, &source, NULL);
+        glCompileShader(shader);
+        GLint status;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+        if (!status) {
+            char log[4096];
+            glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+            std::cerr << "Failed to compile shader:\n" << log << '\n';
+            success = false;
+        }
+        glAttachShader(program, shader);
+        shaders.push_back(shader);
+    }
+    if (success) {
+        if (retrievable) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(program);
+        GLint status;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if (!status) {
+            char log[4096];
+            glGetProgramInfoLog(program, sizeof(log), NULL, log);
+            std::cerr << "Failed to link shader program:\n" << log << '\n';
+            success = false;
+        }
+    }
+    for (GLuint shader : shaders) {
+        glDetachShader(program, shader);
+        glDeleteShader(shader);
+    }
+    if (!success) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// program from the binary cache if the driver takes it, compiled (and cached) otherwise
+// a cache file holds the magic, the key, the binary format, its length and the binary
+// it is written to a temporary file first and renamed, so readers never see half of one
+GLuint load_program(const std::vector<ShaderStage>& stages) {
+    std::string dir = program_cache_dir();
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (dir.empty() || formats == 0) return compile_program(stages);
+
+    uint64_t key = program_key(stages);
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+    std::string filename = dir + '/' + name;
+
+    std::ifstream in(filename, std::ios::binary);
+    if (in) {
+        uint32_t magic = 0;
+        uint64_t file_key = 0;
+        GLenum format = 0;
+        GLint length = 0;
+        in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        in.read(reinterpret_cast<char*>(&file_key), sizeof(file_key));
+        in.read(reinterpret_cast<char*>(&format), sizeof(format));
+        in.read(reinterpret_cast<char*>(&length), sizeof(length));
+        if (in && magic == PROGRAM_CACHE_MAGIC && file_key == key && length > 0) {
+            std::vector<char> binary(length);
+            in.read(binary.data(), length);
+            if (in) {
+                GLuint program = glCreateProgram();
+                glProgramBinary(program, format, binary.data(), length);
+                GLint status;
+                glGetProgramiv(program, GL_LINK_STATUS, &status);
+                if (status) return program;
+                glDeleteProgram(program);
+            }
+        }
+    }
+
+    GLuint program = compile_program(stages, true);
+    if (!program) return 0;
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return program;
+    std::vector<char> binary(length);
+    GLenum format;
+    glGetProgramBinary(program, length, &length, &format, binary.data());
+
+    // failing to cache only costs the next run a compile
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    std::string tmp = filename + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        uint32_t magic = PROGRAM_CACHE_MAGIC;
+        out.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+        out.write(reinterpret_cast<const char*>(&key), sizeof(key));
+        out.write(reinterpret_cast<const char*>(&format), sizeof(format));
+        out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        out.write(binary.data(), length);
+        out.close();
+        if (out.fail()) {
+            std::filesystem::remove(tmp, error);
+            return program;
+        }
+    }
+    std::filesystem::rename(tmp, filename, error);
+    return program;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#define WRITE_QUEUE_MEMORY (size_t(1) << 30)  // bytes
+
+// background queue for encoding and writing finished images, so the next
+// render can start while the last one is still being saved
+// - jobs run in order on a single worker thread
+// - every job declares roughly how much memory it holds, submit blocks
+//   while the queued jobs would go over the budget
+// - flush waits for everything submitted so far
+struct WriteQueue {
+    size_t capacity;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<size_t, std::function<bool()>>> jobs;
+    size_t bytes_in_flight = 0;
+    int jobs_in_flight = 0, failures = 0;
+    bool stop = false;
+    std::thread worker;
+
+    WriteQueue(size_t capacity = WRITE_QUEUE_MEMORY)
+        : capacity(capacity), worker([this] { run(); }) {}
+    WriteQueue(const WriteQueue&) = delete;
+    WriteQueue& operator=(const WriteQueue&) = delete;
+    ~WriteQueue() {
+        flush();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    void submit(size_t bytes, std::function<bool()> job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        // a single job bigger than the budget is still let through on its own
+        cv.wait(lock, [&] { return jobs_in_flight == 0 || bytes_in_flight + bytes <= capacity; });
+        bytes_in_flight += bytes;
+        jobs_in_flight++;
+        jobs.emplace_back(bytes, std::move(job));
+        cv.notify_all();
+    }
+    // true if every job since the last flush succeeded
+    bool flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return jobs_in_flight == 0; });
+        bool success = failures == 0;
+        failures = 0;
+        return success;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [&] { return stop || !jobs.empty(); });
+            if (jobs.empty()) return;
+
+            auto [bytes, job] = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            bool success = job();
+            job = nullptr;  // release the job's buffers before accounting for them
+            lock.lock();
+
+            bytes_in_flight -= bytes;
+            jobs_in_flight--;
+            if (!success) failures++;
+            cv.notify_all();
+        }
+    }
+};
+
+// shared queue used by the render functions, flushed at exit
+WriteQueue& write_queue() {
+    static WriteQueue queue;
+    return queue;
+}
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "camera.h"
+#include "image.h"
+#include "linalg.h"
+#include "program_cache.h"
+#include "sampler.h"
+#include "shader.h"
+
+#define HISTORY_TEXTURE_UNIT (SCENE_TEXTURE_UNIT + 3)  // last frame's accumulation, then depth
+
+// shows the accumulated mean, the only place a realtime frame is gamma corrected
+const char* DISPLAY_SOURCE = R"glsl(#version 330 core
+
+uniform sampler2D accumulation;
+uniform vec2 viewport;
+uniform vec2 region; // rendered part of the target, in texture coordinates
+
+layout(location = 0) out vec4 frag_color;
+
+void main() {
+    // half a texel in from the edge of the region, past it are stale texels
+    vec2 margin = 0.5 / vec2(textureSize(accumulation, 0));
+    vec2 pos = min(gl_FragCoord.xy / viewport * region, region - margin);
+    vec3 color = texture(accumulation, pos).rgb;
+    frag_color = vec4(pow(clamp(color, 0.0, 1.0), vec3(1.0 / 2.2)), 1.0);
+}
+)glsl";
+
+// render_realtime's side of the gpu, on whatever context is current (the window's)
+// - frames go into a pair of float targets: each frame reads the mean so far from
+//   one and writes it, with its own samples folded in, to the other
+// - the mean stays linear at full precision, alpha counts the samples behind it
+// - a frame can render at a fraction of the resolution into the corner of the targets,
+//   display scales it back up
+// - each target also keeps its frame's first hit distance, after a camera move or a
+//   change of scale the next frame reprojects the history with it instead of
+//   starting over, see history in FRAG_SOURCE
+// - display draws the latest target into the default framebuffer
+struct RealtimeShader {
+    ivec2 resolution;
+    ivec2 render_res;  // resolution of the latest frame
+    Camera camera;
+    GLuint program = 0, display_program = 0;
+    GLuint textures[2] = {0, 0};
+    GLuint depth_textures[2] = {0, 0};
+    GLuint fbos[2] = {0, 0};
+    GLuint vao = 0, vbo = 0;
+    GLuint noise_texture = 0;
+    GLuint timer_query = 0;
+    GLint viewport_loc, region_loc;
+    GLint reproject_loc, prev_pos_loc, prev_transform_loc, prev_cell_size_loc, prev_res_loc;
+    int current = 0;  // target holding the latest frame
+    int samples_taken = 0;  // per pixel, since the last reset
+    RenderParams history_params = {};  // what the latest frame was rendered with
+    SceneBuffers scene;
+    ParamsBuffer params;
+
+    RealtimeShader(const Camera& camera, BVH& bvh, int depth, int frame_samples)
+        : resolution(camera.res), render_res(camera.res), camera(camera) {
+        if (!init_gl()) throw std::runtime_error("Failed to initialize RealtimeShader");
+
+        if (!bvh.built) {
+            std::cerr << "Warning: BVH not built\nBuilding BVH...\n";
+            bvh.build();
+        }
+
+        glUseProgram(program);
+        if (!params.create(program)) throw std::runtime_error("Failed to create RenderParams");
+        if (!scene.upload(bvh))
+            throw std::runtime_error("Failed to upload scene to RealtimeShader");
+        glUniform1i(glGetUniformLocation(program, "triangles"), SCENE_TEXTURE_UNIT);
+        glUniform1i(glGetUniformLocation(program, "tri_indices"), SCENE_TEXTURE_UNIT + 1);
+        glUniform1i(glGetUniformLocation(program, "bvh_nodes"), SCENE_TEXTURE_UNIT + 2);
+        glUniform1i(glGetUniformLocation(program, "prev_frame"), HISTORY_TEXTURE_UNIT);
+        glUniform1i(glGetUniformLocation(program, "prev_depth"), HISTORY_TEXTURE_UNIT + 1);
+        set_blue_noise(blue_noise());
+        params.params.render_samples = frame_samples;
+        params.params.render_depth = depth;
+        set_camera(camera);
+        reset();
+    }
+    ~RealtimeShader() {
+        glDeleteProgram(program);
+        glDeleteProgram(display_program);
+        glDeleteTextures(2, textures);
+        glDeleteTextures(2, depth_textures);
+        glDeleteFramebuffers(2, fbos);
+        glDeleteVertexArrays(1, &vao);
+        glDeleteBuffers(1, &vbo);
+        glDeleteTextures(1, &noise_texture);
+        glDeleteQueries(1, &timer_query);
+        scene.release();
+        params.release();
+    }
+
+    bool init_gl() {
+        // the scene goes through raw gl buffer textures, glew
+        // needs the window's context to be active to load them
+        if (glewInit() != GLEW_OK) {
+            std::cerr << "Failed to initialize GLEW\n";
+            return false;
+        }
+
+        // cant think of a better way to define REALTIME
+        std::string frag_source =
+            "#version 330 core\n#define REALTIME\n//" + std::string(FRAG_SOURCE);
+        program =
+            load_program({{GL_VERTEX_SHADER, VERT_SOURCE}, {GL_FRAGMENT_SHADER, frag_source}});
+        display_program =
+            load_program({{GL_VERTEX_SHADER, VERT_SOURCE}, {GL_FRAGMENT_SHADER, DISPLAY_SOURCE}});
+        if (!program || !display_program) return false;
+        glUseProgram(display_program);
+        glUniform1i(glGetUniformLocation(display_program, "accumulation"), HISTORY_TEXTURE_UNIT);
+        viewport_loc = glGetUniformLocation(display_program, "viewport");
+        region_loc = glGetUniformLocation(display_program, "region");
+        reproject_loc = glGetUniformLocation(program, "reproject");
+        prev_pos_loc = glGetUniformLocation(program, "prev_pos");
+        prev_transform_loc = glGetUniformLocation(program, "prev_transform");
+        prev_cell_size_loc = glGetUniformLocation(program, "prev_cell_size");
+        prev_res_loc = glGetUniformLocation(program, "prev_res");
+
+        // float ping-pong targets and their depth, linear so they can be resampled
+        glGenTextures(2, textures);
+        glGenTextures(2, depth_textures);
+        glGenFramebuffers(2, fbos);
+        const GLenum buffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+        for (int i = 0; i < 2; i++) {
+            const GLuint attachments[2] = {textures[i], depth_textures[i]};
+            const GLenum formats[2] = {GL_RGBA32F, GL_R32F};
+            glBindFramebuffer(GL_FRAMEBUFFER, fbos[i]);
+            for (int j = 0; j < 2; j++) {
+                glBindTexture(GL_TEXTURE_2D, attachments[j]);
+                glTexImage2D(GL_TEXTURE_2D, 0, formats[j], resolution.x, resolution.y, 0,
+                             GL_RGBA, GL_FLOAT, NULL);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+                glFramebufferTexture2D(GL_FRAMEBUFFER, buffers[j], GL_TEXTURE_2D,
+                                       attachments[j], 0);
+            }
+            glDrawBuffers(2, buffers);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                std::cerr << "Failed to create FBO\n";
+                return false;
+            }
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        // one quad for every draw
+        const std::array<float, 8> vertices = {-1, -1, 1, -1, -1, 1, 1, 1};
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vbo);
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(),
+                     GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+        glGenQueries(1, &timer_query);
+        return true;
+    }
+    void set_blue_noise(const BlueNoise& noise) {
+        glGenTextures(1, &noise_texture);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, noise_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, noise.size, noise.size, 0, GL_RED, GL_FLOAT,
+                     noise.values.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(glGetUniformLocation(program, "blue_noise"), 1);
+    }
+
+    void set_camera(const Camera& camera) {
+        this->camera = camera;
+        set_render_res(render_res);
+    }
+    void set_render_res(const ivec2& res) {
+        // same view at another resolution, the pixels just get bigger
+        render_res = component_min(res, resolution);
+        params.params.set_camera(camera);
+        params.params.camera_res = render_res;
+        params.params.camera_cell_size = camera.cell_size * resolution.x / render_res.x;
+        params.upload();
+    }
+    void reset() {
+        // drop the history, the next frame starts a new mean
+        samples_taken = 0;
+        for (GLuint fbo : fbos) {
+            glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+            glClearColor(0, 0, 0, 0);
+            glClear(GL_COLOR_BUFFER_BIT);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    // adds a frame of samples per pixel to the mean at scale times the resolution,
+    // returns the milliseconds the gpu took, waiting for it
+    float render(int frame, int samples, float scale = 1) {
+        ivec2 res = component_max(
+            ivec2(int(resolution.x * scale), int(resolution.y * scale)), ivec2(1));
+        if (res != render_res) set_render_res(res);
+        params.params.frame = frame;
+        params.params.render_samples = samples;
+        params.params.sample_offset = samples_taken;
+        params.upload();
+
+        // the camera block is everything before render_samples
+        bool moved = std::memcmp(&params.params, &history_params,
+                                 offsetof(RenderParams, render_samples)) != 0;
+        set_reproject(samples_taken > 0 && moved);
+        samples_taken += samples;
+        history_params = params.params;
+        return timed_draw(timer_query, [&] { draw(); });
+    }
+    void set_reproject(bool reproject) {
+        glUseProgram(program);
+        glUniform1i(reproject_loc, reproject);
+        if (!reproject) return;
+        const RenderParams& prev = history_params;
+        glUniform3f(prev_pos_loc, prev.camera_pos.x, prev.camera_pos.y, prev.camera_pos.z);
+        glUniformMatrix4fv(prev_transform_loc, 1, GL_FALSE, prev.camera_transform.data());
+        glUniform1f(prev_cell_size_loc, prev.camera_cell_size);
+        glUniform2i(prev_res_loc, prev.camera_res.x, prev.camera_res.y);
+    }
+    void draw() {
+        params.bind();
+        scene.bind();
+
+        int next = 1 - current;
+        glBindFramebuffer(GL_FRAMEBUFFER, fbos[next]);
+        glViewport(0, 0, render_res.x, render_res.y);
+        glDisable(GL_BLEND);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, noise_texture);
+        glActiveTexture(GL_TEXTURE0 + HISTORY_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_2D, textures[current]);
+        glActiveTexture(GL_TEXTURE0 + HISTORY_TEXTURE_UNIT + 1);
+        glBindTexture(GL_TEXTURE_2D, depth_textures[current]);
+        glActiveTexture(GL_TEXTURE0);
+        glUseProgram(program);
+        glBindVertexArray(vao);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        current = next;
+    }
+    // draws the latest mean over the default framebuffer of size viewport
+    void display(const ivec2& viewport) {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, viewport.x, viewport.y);
+        glActiveTexture(GL_TEXTURE0 + HISTORY_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_2D, textures[current]);
+        glActiveTexture(GL_TEXTURE0);
+        glUseProgram(display_program);
+        glUniform2f(viewport_loc, viewport.x, viewport.y);
+        vec2 region = vec2(render_res) / vec2(resolution);
+        glUniform2f(region_loc, region.x, region.y);
+        glBindVertexArray(vao);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+    Image read_image() {
+        // the latest mean at the resolution it was rendered at, linear
+        Image image(render_res);
+        std::vector<float> pixels(size_t(resolution.x) * resolution.y * 4);
+        glBindTexture(GL_TEXTURE_2D, textures[current]);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, pixels.data());
+        for (int h = 0; h < render_res.y; h++) {
+            for (int w = 0; w < render_res.x; w++) {
+                const float* p = &pixels[(size_t(h) * resolution.x + w) * 4];
+                image.pixel(w, h) = vec3(p[0], p[1], p[2]);
+            }
+        }
+        return image;
+    }
+};
@@ -1,17 +1,28 @@
 #pragma once
 
-#include <SFML/Graphics.hpp>
+#include <SFML/Window.hpp>
 #include <iomanip>
 #include <ios>
 #include <iostream>
+#include <memory>
 #include <thread>
 #include <filesystem>
 
+#include "aov.h"
 #include "bvh.h"
 #include "camera.h"
+#include "checkpoint.h"
+#include "denoise.h"
 #include "image.h"
 #include "linalg.h"
+#include "queue.h"
+#include "realtime.h"
+#include "sampler.h"
+#include "scheduler.h"
 #include "shader.h"
+#include "stats.h"
+#include "stream.h"
+#include "wavefront.h"
 
 #define SHIFT_BIAS 1e-4
 
@@ -33,14 +44,37 @@ struct Timer {
     }
 };
 
-vec3 trace(const BVH& bvh, const vec3& ray_o, const vec3& ray_d, int depth) {
+void fill_aov(const BVH& bvh, int hit_idx, const vec3& ray_o, const vec3& ray_d, float hit_t,
+              AOVSample& aov) {
+    const Triangle& tri = bvh.triangles[hit_idx];
+    aov.normal = tri.normal(ray_d, ray_o + ray_d * hit_t);
+    // lights keep their emission as is when the denoiser demodulates
+    aov.albedo = tri.material.type == Material::EMIT ? vec3(1) : tri.material.color;
+    aov.depth = hit_t;
+    aov.triangle_id = hit_idx;
+}
+AOVSample first_hit(const BVH& bvh, const vec3& ray_o, const vec3& ray_d) {
+    AOVSample aov;
+    float hit_t;
+    int hit_idx = bvh.intersect_stackless(ray_o, ray_d, hit_t);
+    if (hit_idx != -1) fill_aov(bvh, hit_idx, ray_o, ray_d, hit_t, aov);
+    return aov;
+}
+
+vec3 trace(const BVH& bvh, const vec3& ray_o, const vec3& ray_d, int depth);
+vec3 trace(const BVH& bvh, const vec3& ray_o, const vec3& ray_d, int depth, const vec2& sample,
+           AOVSample* aov = nullptr) {
+    // sample is used for the direction of this bounce,
+    // the rest of the path is sampled randomly
+    // aov, if given, receives what this ray hits
     if (depth == 0) return 0;
 
     float hit_t;
-    int hit_idx = bvh.intersect(ray_o, ray_d, hit_t);
+    int hit_idx = bvh.intersect_stackless(ray_o, ray_d, hit_t);
     if (hit_idx == -1) return 0;
 
     const Triangle& tri = bvh.triangles[hit_idx];
+    if (aov) fill_aov(bvh, hit_idx, ray_o, ray_d, hit_t, *aov);
     if (tri.material.type == Material::EMIT) {
         return tri.material.emit_color;
     }
@@ -48,7 +82,7 @@ vec3 trace(const BVH& bvh, const vec3& ray_o, const vec3& ray_d, int depth) {
     vec3 hit_p = ray_o + ray_d * hit_t;
     vec3 hit_n = tri.normal(ray_d, hit_p);
 
-    vec3 new_d = tri.material.reflected_dir(ray_d, hit_n);
+    vec3 new_d = tri.material.reflected_dir(ray_d, hit_n, sample);
     vec3 new_o = hit_p + hit_n * SHIFT_BIAS;
 
     vec3 rec_color = trace(bvh, new_o, new_d, depth - 1);
@@ -59,8 +93,51 @@ vec3 trace(const BVH& bvh, const vec3& ray_o, const vec3& ray_d, int depth) {
     // multiply by 2 to account for cosine
     return emission + 2 * rec_color * surface_color * cos_theta;
 }
+vec3 trace(const BVH& bvh, const vec3& ray_o, const vec3& ray_d, int depth) {
+    float u = rng.rand01(), v = rng.rand01();
+    return trace(bvh, ray_o, ray_d, depth, vec2(u, v));
+}
+// optional extras for the render functions,
+// render_gpu only uses aovs, chunk_latency, pass_samples, time_limit and previews
+// render_gpu_wavefront only uses time_limit
+// render_hybrid only uses chunk_latency and threads
+struct RenderOptions {
+    // with a checkpoint file the render state is saved every checkpoint_interval
+    // seconds and a matching checkpoint is resumed from, giving the same image
+    // as an uninterrupted render
+    std::string checkpoint_file;
+    float checkpoint_interval = CHECKPOINT_INTERVAL;
+    // gather first hit normal, albedo and depth and filter the image with them
+    bool denoise = false;
+    Denoiser denoiser;
+    // also write the first hit buffers (normal, albedo, depth, material and
+    // triangle id) to a multichannel exr next to the image, see aov_filename
+    bool aovs = false;
+    // track per pixel luminance mean and variance (render_cpu only), print the
+    // mean variance of the pixels as a noise figure and write a variance map
+    // to <name>.variance.exr
+    bool stats = false;
+    // render_gpu sizes its chunks to take about this many milliseconds each,
+    // starting from chunk_size, 0 renders every chunk at chunk_size
+    float chunk_latency = GPU_CHUNK_LATENCY;
+    // render_gpu takes the samples in passes of this many per pixel, summed in
+    // a float buffer, 0 takes them all in one pass
+    int pass_samples = 0;
+    // stop render_gpu after the first pass that ends past this many seconds
+    // and save what was accumulated so far, 0 for no limit
+    float time_limit = 0;
+    // write the image after every render_gpu pass, not only at the end
+    bool previews = false;
+    // cpu threads next to the gpu in render_hybrid, 0 for one per hardware
+    // thread but the one driving the gpu
+    int threads = 0;
+
+    RenderOptions() = default;
+};
+
 bool render_cpu(const Camera& camera, BVH& bvh, int samples, int depth,
-                const std::string& filename) {
+                const std::string& filename, const RenderOptions& options = RenderOptions()) {
+    const std::string& checkpoint_file = options.checkpoint_file;
     if (bvh.empty()) {
         std::cerr << "No triangles in scene.\n";
         return false;
@@ -71,33 +148,183 @@ bool render_cpu(const Camera& camera, BVH& bvh, int samples, int depth,
     }
 
     auto [width, height] = camera.res;
-    Image image(camera.res);
+    uint64_t hash = scene_hash(camera, bvh, samples, depth);
+    Checkpoint state(hash, camera.res, samples, depth, options.stats);
+    state.rng_state = rng.state;
+    if (!checkpoint_file.empty() && std::filesystem::exists(checkpoint_file)) {
+        Checkpoint saved;
+        bool loaded = saved.load(checkpoint_file) && saved.hash == hash;
+        if (loaded && saved.stats.empty() != options.stats) {
+            state = std::move(saved);
+            rng.seed(state.rng_state);
+            std::cout << "Resuming from " << checkpoint_file << " at row " << state.next_row
+                      << ".\n";
+        } else if (loaded) {
+            // same scene, but the stats so far can't be made up (or aren't wanted)
+            std::cerr << "Checkpoint was taken " << (options.stats ? "without" : "with")
+                      << " stats, starting over.\n";
+        } else {
+            std::cerr << "Checkpoint does not match the scene, starting over.\n";
+        }
+    }
+    Image& image = state.image;
+    const BlueNoise& noise = blue_noise();
     vec3 ray_o, ray_d;
 
-    Timer timer;
+    // aovs are cheap to recompute, so they are not part of the checkpoint
+    const bool gather_aovs = options.denoise || options.aovs;
+    AOVs aovs(gather_aovs ? camera.res : ivec2(0, 0));
+    AOVSample aov;
+    for (int h = 0; gather_aovs && h < state.next_row; h++) {
+        for (int w = 0; w < width; w++) {
+            for (int s = 0; s < samples; s++) {
+                camera.get_ray(w, h, noise.sample2d(w, h, s, BlueNoise::PIXEL), ray_o, ray_d);
+                aovs.add(w, h, first_hit(bvh, ray_o, ray_d));
+            }
+        }
+    }
+
+    Timer timer, checkpoint_timer;
     timer.start();
-    std::cout << "Rendered: 0/" << height << " rows.";
-    for (int h = 0; h < height; h++) {
+    checkpoint_timer.start();
+    std::cout << "Rendered: " << state.next_row << '/' << height << " rows.";
+    for (int h = state.next_row; h < height; h++) {
+        // seeded by row, so the image doesn't depend on the order rows are rendered in
+        rng.seed(SEED + h);
         for (int w = 0; w < width; w++) {
             for (int s = 0; s < samples; s++) {
-                camera.get_ray(w, h, ray_o, ray_d);
-                image.get_pixel(w, h) += trace(bvh, ray_o, ray_d, depth);
+                vec2 jitter = noise.sample2d(w, h, s, BlueNoise::PIXEL);
+                vec2 bounce = noise.sample2d(w, h, s, BlueNoise::BOUNCE);
+                camera.get_ray(w, h, jitter, ray_o, ray_d);
+                aov = AOVSample();
+                vec3 color = trace(bvh, ray_o, ray_d, depth, bounce, gather_aovs ? &aov : nullptr);
+                image.pixel(w, h) += color;
+                if (gather_aovs) aovs.add(w, h, aov);
+                if (options.stats) state.stats.add(w, h, color);
             }
+            state.counts[size_t(h) * width + w] = samples;
         }
         std::cout << "\rRendered: " << (h + 1) << '/' << height << " rows." << std::flush;
+
+        // checkpoints are only taken between rows, every row reseeds the rng
+        if (!checkpoint_file.empty() && h + 1 < height &&
+            checkpoint_timer.seconds() >= options.checkpoint_interval) {
+            state.next_row = h + 1;
+            state.rng_state = rng.state;
+            state.save(checkpoint_file);
+            checkpoint_timer.reset();
+        }
     }
     float seconds = timer.seconds();
 
     std::ios old_state(nullptr);
     old_state.copyfmt(std::cout);
     std::cout << std::fixed << std::setprecision(2);
-    std::cout << "\nDone in " << seconds << " seconds.\nColor correcting...\n";
+    std::cout << "\nDone in " << seconds << " seconds.\n";
+    if (options.stats) {
+        std::cout << std::scientific;
+        std::cout << "Mean pixel variance: " << state.stats.mean_error() << '\n';
+        std::cout << std::fixed;
+    }
+
+    if (options.denoise) {
+        timer.reset();
+        std::cout << "Denoising...\n";
+        options.denoiser.apply(image, aovs, samples);
+        std::cout << "Denoised in " << timer.seconds() << " seconds.\n";
+    }
+    std::cout << "Color correcting...\n";
     std::cout.copyfmt(old_state);
 
-    image /= samples;
-    // gamma correct
-    image.gamma_correct(2.2);
-    image.save_png(filename);
+    // average, gamma correct and quantize in one pass (or write linear floats for .exr/.pfm)
+    // on the write queue, so the caller can start the next render right away
+    size_t bytes = image.channels() * sizeof(float);
+    write_queue().submit(bytes, [image = std::move(image), filename, samples, checkpoint_file] {
+        if (!image.save(filename, samples)) return false;
+        std::cout << "Saved to " << filename << '\n';
+
+        // the finished image supersedes the checkpoint, failing to
+        // remove it must not take the write queue down with it
+        if (!checkpoint_file.empty()) {
+            std::error_code error;
+            std::filesystem::remove(checkpoint_file, error);
+        }
+        return true;
+    });
+    if (options.aovs) {
+        aovs.resolve_materials(bvh.triangles);
+        std::string aov_file = aov_filename(filename);
+        write_queue().submit(bytes * 3, [aovs = std::move(aovs), aov_file, samples] {
+            if (!aovs.save(aov_file, samples)) return false;
+            std::cout << "Saved to " << aov_file << '\n';
+            return true;
+        });
+    }
+    if (options.stats) {
+        std::string stats_file = sidecar_filename(filename, ".variance.exr");
+        size_t stats_bytes = state.stats.count.size() * (sizeof(uint32_t) + 2 * sizeof(float));
+        write_queue().submit(stats_bytes, [stats = std::move(state.stats), stats_file] {
+            if (!stats.save(stats_file)) return false;
+            std::cout << "Saved to " << stats_file << '\n';
+            return true;
+        });
+    }
+
+    return true;
+}
+
+bool render_cpu_stream(const Camera& camera, BVH& bvh, int samples, int depth,
+                       const std::string& filename, int band_rows = STREAM_BAND_ROWS) {
+    // out of core variant of render_cpu for very large images: rows are rendered
+    // top to bottom in bands of band_rows, each finished band goes straight to
+    // the file so only one band is ever held in memory
+    if (bvh.empty()) {
+        std::cerr << "No triangles in scene.\n";
+        return false;
+    }
+    if (!bvh.built) {
+        std::cerr << "Bounding volume heirarchy not built.\nBuilding...\n";
+        bvh.build();
+    }
+
+    auto [width, height] = camera.res;
+    StreamWriter writer;
+    if (!writer.open(filename, camera.res, samples)) return false;
+    const BlueNoise& noise = blue_noise();
+    vec3 ray_o, ray_d;
+    Image band;
+
+    Timer timer;
+    timer.start();
+    std::cout << "Rendered: 0/" << height << " rows.";
+    for (int top = height; top > 0; top -= band_rows) {
+        int bottom = std::max(top - band_rows, 0);
+        if (band.res != ivec2(width, top - bottom)) band = Image(ivec2(width, top - bottom));
+        std::fill(band.pixels.begin(), band.pixels.end(), vec3(0));
+
+        for (int h = top - 1; h >= bottom; h--) {
+            // seeded by row like render_cpu, which goes bottom to top
+            rng.seed(SEED + h);
+            for (int w = 0; w < width; w++) {
+                for (int s = 0; s < samples; s++) {
+                    vec2 jitter = noise.sample2d(w, h, s, BlueNoise::PIXEL);
+                    vec2 bounce = noise.sample2d(w, h, s, BlueNoise::BOUNCE);
+                    camera.get_ray(w, h, jitter, ray_o, ray_d);
+                    band.pixel(w, h - bottom) += trace(bvh, ray_o, ray_d, depth, bounce);
+                }
+            }
+        }
+        if (!writer.write_band(band, bottom)) return false;
+        std::cout << "\rRendered: " << (height - bottom) << '/' << height << " rows."
+                  << std::flush;
+    }
+    if (!writer.close()) return false;
+
+    std::ios old_state(nullptr);
+    old_state.copyfmt(std::cout);
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "\nDone in " << timer.seconds() << " seconds.\n";
+    std::cout.copyfmt(old_state);
     std::cout << "Saved to " << filename << '\n';
 
     return true;
@@ -107,7 +334,7 @@ int ceildiv(int a, int b) {
     return (a + b - 1) / b;
 }
 bool render_gpu(const Camera& camera, BVH& bvh, int samples, int depth, const ivec2& chunk_size,
-                const std::string& filename) {
+                const std::string& filename, const RenderOptions& options = RenderOptions()) {
     if (bvh.empty()) {
         std::cerr << "No triangles in scene.\n";
         return false;
@@ -118,23 +345,80 @@ bool render_gpu(const Camera& camera, BVH& bvh, int samples, int depth, const iv
     }
 
     // render in chunks as to not crash the operating system
-    int total_chunks = ceildiv(camera.res.x, chunk_size.x) * ceildiv(camera.res.y, chunk_size.y);
-    int rendered_chunks = 0;
-    PathtraceShader shader = PathtraceShader(camera, bvh, samples, depth);
+    PathtraceShader shader = PathtraceShader(camera, bvh, samples, depth, options.aovs);
+
+    // passes add onto a float buffer, the image is only
+    // normalized and gamma corrected when read back
+    const int pass_samples = options.pass_samples > 0 ? std::min(options.pass_samples, samples)
+                                                      : samples;
+    const int total_passes = ceildiv(samples, pass_samples);
+    ChunkScheduler scheduler(camera.res, chunk_size, options.chunk_latency);
+    int done_samples = 0, passes = 0;
+
+    // a preview's readback is queued behind its pass and collected once the next
+    // pass has its first chunk in, so rendering never waits on the copy
+    bool preview_pending = false;
+    auto collect_preview = [&] {
+        if (!preview_pending) return;
+        preview_pending = false;
+        write_queue().submit(size_t(camera.res.x) * camera.res.y * sizeof(vec3),
+                             [image = shader.finish_readback(), filename] {
+                                 return image.save(filename);
+                             });
+    };
 
     Timer timer;
     timer.start();
-    std::cout << "Rendered: 0/" << total_chunks << " chunks.";
-    for (int i = 0; i < camera.res.x; i += chunk_size.x) {
-        for (int j = 0; j < camera.res.y; j += chunk_size.y) {
-            ivec2 top_left = ivec2(i, j);
-            ivec2 bottom_right = ivec2(i + chunk_size.x, j + chunk_size.y);
-            shader.draw_rect(top_left, bottom_right);
-            shader.finish();
-
-            rendered_chunks++;
-            std::cout << "\rRendered: " << rendered_chunks << '/' << total_chunks << " chunks."
-                      << std::flush;
+    while (done_samples < samples) {
+        int pass = std::min(pass_samples, samples - done_samples);
+        shader.set_pass(pass, done_samples);
+        if (options.chunk_latency > 0) {
+            scheduler.restart();
+            std::cout << "\rPass " << passes + 1 << '/' << total_passes << ", rendered: 0%.";
+            while (!scheduler.done()) {
+                ivec2 top_left, bottom_right;
+                scheduler.next(top_left, bottom_right);
+                float ms = shader.draw_rect_timed(top_left, bottom_right);
+                scheduler.record(top_left, bottom_right, ms);
+                collect_preview();
+
+                std::cout << "\rPass " << passes + 1 << '/' << total_passes
+                          << ", rendered: " << int(scheduler.progress()) << "% in "
+                          << scheduler.chunks << " chunks." << std::flush;
+            }
+        } else {
+            int total_chunks =
+                ceildiv(camera.res.x, chunk_size.x) * ceildiv(camera.res.y, chunk_size.y);
+            int rendered_chunks = 0;
+            std::cout << "\rPass " << passes + 1 << '/' << total_passes << ", rendered: 0/"
+                      << total_chunks << " chunks.";
+            for (int i = 0; i < camera.res.x; i += chunk_size.x) {
+                for (int j = 0; j < camera.res.y; j += chunk_size.y) {
+                    ivec2 top_left = ivec2(i, j);
+                    ivec2 bottom_right = ivec2(i + chunk_size.x, j + chunk_size.y);
+                    shader.draw_rect(top_left, bottom_right);
+                    shader.finish();
+                    collect_preview();
+
+                    rendered_chunks++;
+                    std::cout << "\rPass " << passes + 1 << '/' << total_passes
+                              << ", rendered: " << rendered_chunks << '/' << total_chunks
+                              << " chunks." << std::flush;
+                }
+            }
+        }
+        done_samples += pass;
+        passes++;
+
+        if (options.time_limit > 0 && done_samples < samples &&
+            timer.seconds() >= options.time_limit) {
+            std::cout << "\nTime limit reached after " << done_samples << '/' << samples
+                      << " samples.";
+            break;
+        }
+        if (options.previews && done_samples < samples) {
+            shader.start_readback();
+            preview_pending = true;
         }
     }
     float seconds = timer.seconds();
@@ -145,79 +429,180 @@ bool render_gpu(const Camera& camera, BVH& bvh, int samples, int depth, const iv
     std::cout << "\nDone in " << seconds << " seconds.\n";
     std::cout.copyfmt(old_state);
 
-    shader.save_png(filename);
-    std::cout << "Saved to " << filename << '\n';
+    // readback has to happen on this thread, encoding and writing is queued
+    // the buffer already holds the mean, so the image is saved with one sample
+    Image image = shader.read_image();
+    size_t bytes = image.channels() * sizeof(float);
+    write_queue().submit(bytes, [image = std::move(image), filename] {
+        if (!image.save(filename)) return false;
+        std::cout << "Saved to " << filename << '\n';
+        return true;
+    });
+    if (options.aovs) {
+        AOVs aovs = shader.read_aovs();
+        aovs.resolve_materials(bvh.triangles);
+        std::string aov_file = aov_filename(filename);
+        write_queue().submit(aovs.depth.size() * 40, [aovs = std::move(aovs), aov_file] {
+            if (!aovs.save(aov_file)) return false;
+            std::cout << "Saved to " << aov_file << '\n';
+            return true;
+        });
+    }
 
     return true;
 }
 
-bool sf_load_shader(const std::string& filename, sf::Shader& shader) {
-    if (!sf::Shader::isAvailable()) {
-        std::cerr << "Shaders are not available\n";
+bool render_gpu_wavefront(const Camera& camera, BVH& bvh, int samples, int depth,
+                          const std::string& filename,
+                          const RenderOptions& options = RenderOptions()) {
+    // same image as render_gpu with the compute shader backend, needs opengl 4.3
+    // every sample is a handful of short dispatches over the whole image
+    if (bvh.empty()) {
+        std::cerr << "No triangles in scene.\n";
         return false;
     }
-    // cant think of a better way to define REALTIME
-    const std::string realtime_shader =
-        "#version 330 core\n#define REALTIME\n//" + std::string(FRAG_SOURCE);
-    if (!shader.loadFromMemory(realtime_shader, sf::Shader::Fragment)) {
-        std::cerr << "Failed to load shader\n";
+    if (!bvh.built) {
+        std::cerr << "Bounding volume heirarchy not built.\nBuilding...\n";
+        bvh.build();
+    }
+
+    // no opengl 4.3 (macos, older mesa) is a failed render, not a crash
+    std::unique_ptr<WavefrontShader> shader;
+    try {
+        shader = std::make_unique<WavefrontShader>(camera, bvh, depth);
+    } catch (const std::runtime_error& error) {
+        std::cerr << error.what() << '\n';
         return false;
     }
+
+    Timer timer;
+    timer.start();
+    int done_samples = 0;
+    std::cout << "Rendered: 0/" << samples << " samples.";
+    while (done_samples < samples) {
+        shader->sample(done_samples);
+        shader->finish();
+        done_samples++;
+        std::cout << "\rRendered: " << done_samples << '/' << samples << " samples." << std::flush;
+
+        if (options.time_limit > 0 && done_samples < samples &&
+            timer.seconds() >= options.time_limit) {
+            std::cout << "\nTime limit reached after " << done_samples << '/' << samples
+                      << " samples.";
+            break;
+        }
+    }
+    float seconds = timer.seconds();
+
+    std::ios old_state(nullptr);
+    old_state.copyfmt(std::cout);
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "\nDone in " << seconds << " seconds.\n";
+    std::cout.copyfmt(old_state);
+
+    Image image = shader->read_image();
+    size_t bytes = image.channels() * sizeof(float);
+    write_queue().submit(bytes, [image = std::move(image), filename] {
+        if (!image.save(filename)) return false;
+        std::cout << "Saved to " << filename << '\n';
+        return true;
+    });
     return true;
 }
-sf::Glsl::Vec3 sf_vec3(const vec3& v) {
-    return sf::Glsl::Vec3(v.x, v.y, v.z);
-}
-sf::Glsl::Vec2 sf_vec2(const vec2& v) {
-    return sf::Glsl::Vec2(v.x, v.y);
-}
-sf::Glsl::Ivec2 sf_ivec2(const ivec2& v) {
-    return sf::Glsl::Ivec2(v.x, v.y);
-}
-void sf_set_uniform(sf::Shader& shader, const BVH& bvh) {
-    // load triangle indices
-    for (size_t i = 0; i < bvh.tri_idx.size(); i++) {
-        std::string name = "tri_indices[" + std::to_string(i) + "]";
-        shader.setUniform(name, bvh.tri_idx[i]);
+
+bool render_hybrid(const Camera& camera, BVH& bvh, int samples, int depth, const ivec2& chunk_size,
+                   const std::string& filename, const RenderOptions& options = RenderOptions()) {
+    // render_gpu and a pool of cpu threads on the same image at once, every row is
+    // rendered by one side with all its samples, see HybridScheduler for the split
+    if (bvh.empty()) {
+        std::cerr << "No triangles in scene.\n";
+        return false;
+    }
+    if (!bvh.built) {
+        std::cerr << "Bounding volume heirarchy not built.\nBuilding...\n";
+        bvh.build();
     }
 
-    // load triangles
-    for (size_t i = 0; i < bvh.triangles.size(); i++) {
-        const Triangle& tri = bvh.triangles[i];
-        std::string name = "triangles[" + std::to_string(i) + "].";
-        shader.setUniform(name + "v1", sf_vec3(tri.v1));
-        shader.setUniform(name + "v2", sf_vec3(tri.v2));
-        shader.setUniform(name + "v3", sf_vec3(tri.v3));
-
-        name += "material.";
-        shader.setUniform(name + "type", tri.material.type);
-        shader.setUniform(name + "color", sf_vec3(tri.material.color));
-        shader.setUniform(name + "emit_color", sf_vec3(tri.material.emit_color));
-        shader.setUniform(name + "roughness", tri.material.roughness);
+    PathtraceShader shader = PathtraceShader(camera, bvh, samples, depth);
+    shader.set_pass(samples, 0);
+    HybridScheduler scheduler(camera.res, chunk_size, options.chunk_latency);
+
+    // cpu rows are summed here and merged into the gpu's image at the end
+    auto [width, height] = camera.res;
+    Image cpu_image(camera.res);
+    std::vector<char> cpu_row(height, 0);
+    const BlueNoise& noise = blue_noise();
+    auto cpu_worker = [&] {
+        vec3 ray_o, ray_d;
+        int h;
+        while (scheduler.take_cpu(h)) {
+            auto start = std::chrono::steady_clock::now();
+            // seeded by row, so the image doesn't depend on which thread took it
+            rng.seed(SEED + h);
+            for (int w = 0; w < width; w++) {
+                for (int s = 0; s < samples; s++) {
+                    vec2 jitter = noise.sample2d(w, h, s, BlueNoise::PIXEL);
+                    vec2 bounce = noise.sample2d(w, h, s, BlueNoise::BOUNCE);
+                    camera.get_ray(w, h, jitter, ray_o, ray_d);
+                    cpu_image.pixel(w, h) += trace(bvh, ray_o, ray_d, depth, bounce);
+                }
+            }
+            cpu_row[h] = 1;
+            // Timer only has whole milliseconds, short rows would read as free
+            std::chrono::duration<float, std::milli> ms = std::chrono::steady_clock::now() - start;
+            scheduler.record_cpu(ms.count());
+        }
+    };
+
+    // this thread drives the gpu, so by default every other hardware thread renders
+    int threads = options.threads > 0 ? options.threads : std::max(thread_count() - 1, 1);
+    Timer timer;
+    timer.start();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) workers.emplace_back(cpu_worker);
+
+    // full width bands while the budget covers a row, pieces of one row otherwise
+    std::cout << "Rendered: 0%.";
+    int start, count;
+    while (scheduler.take_gpu(int(scheduler.gpu_budget() / width), start, count)) {
+        for (int x = 0; x < width;) {
+            long long budget = count > 1 ? width : scheduler.gpu_budget();
+            int w = int(std::min(budget, (long long)width - x));
+            float ms = shader.draw_rect_timed(ivec2(x, start), ivec2(x + w, start + count));
+            scheduler.record_gpu((long long)w * count, ms);
+            x += w;
+        }
+        std::cout << "\rRendered: " << int(scheduler.progress()) << "%." << std::flush;
     }
+    for (std::thread& worker : workers) worker.join();
+    float seconds = timer.seconds();
 
-    // load bvh nodes
-    for (size_t i = 0; i < bvh.nodes.size(); i++) {
-        const BVHNode& node = bvh.nodes[i];
-        std::string name = "bvh_nodes[" + std::to_string(i) + "].";
-        shader.setUniform(name + "aabb.lb", sf_vec3(node.aabb.lb));
-        shader.setUniform(name + "aabb.rt", sf_vec3(node.aabb.rt));
-        shader.setUniform(name + "left", node.left);
-        shader.setUniform(name + "right", node.right);
-        shader.setUniform(name + "tri_start", node.tri_start);
-        shader.setUniform(name + "tri_end", node.tri_end);
+    std::ios old_state(nullptr);
+    old_state.copyfmt(std::cout);
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "\rRendered: 100%.\nDone in " << seconds << " seconds.\n";
+    std::cout << "GPU rendered " << scheduler.gpu_rows << " rows, " << threads
+              << " CPU threads rendered " << scheduler.cpu_rows << " rows.\n";
+    std::cout.copyfmt(old_state);
+
+    // the gpu's rows already hold the mean, cpu rows are averaged into them
+    Image image = shader.read_image();
+    for (int h = 0; h < height; h++) {
+        if (!cpu_row[h]) continue;
+        for (int w = 0; w < width; w++) image.pixel(w, h) = cpu_image.pixel(w, h) / samples;
     }
+    size_t bytes = image.channels() * sizeof(float);
+    write_queue().submit(bytes, [image = std::move(image), filename] {
+        if (!image.save(filename)) return false;
+        std::cout << "Saved to " << filename << '\n';
+        return true;
+    });
+    return true;
 }
-void sf_set_uniform(sf::Shader& shader, const Camera& camera) {
-    shader.setUniform("camera.pos", sf_vec3(camera.pos));
-    shader.setUniform("camera.res", sf_ivec2(camera.res));
-    shader.setUniform("camera.v_res", sf_vec2(camera.v_res));
-    shader.setUniform("camera.cell_size", camera.cell_size);
-    shader.setUniform("camera.image_distance", camera.distance);
-    shader.setUniform("camera.transform", sf::Glsl::Mat4(camera.transform.data()));
-}
+
+// with adaptive, frame_samples is the most samples a frame takes, see FrameController
 void render_realtime(const Camera& camera, BVH& bvh, int depth, int frame_samples, const std::string &screenshot_dir, int fps = 30,
-                     bool accumulate = true, bool vsync = false) {
+                     bool accumulate = true, bool vsync = false, bool adaptive = true) {
     if (bvh.empty()) {
         std::cerr << "No triangles in scene.\n";
         return;
@@ -228,22 +613,17 @@ void render_realtime(const Camera& camera, BVH& bvh, int depth, int frame_sample
     }
     Camera cam = camera;
 
-    std::cout << "Loading shader...";
-    sf::Shader shader;
-    if (!sf_load_shader(FRAG_SOURCE, shader)) return;
-    shader.setUniform("render_samples", frame_samples);
-    shader.setUniform("render_depth", depth);
-    sf_set_uniform(shader, bvh);
-    std::cout << "\rShader loaded.   \n";
-
-    std::cout << "Creating window and texture...";
-    sf::RenderWindow window(sf::VideoMode(cam.res.x, cam.res.y), "Pathtracer");
+    std::cout << "Creating window...";
+    sf::Window window(sf::VideoMode(cam.res.x, cam.res.y), "Pathtracer");
     window.setVerticalSyncEnabled(vsync);
     window.setFramerateLimit(fps);
-    const sf::RectangleShape rect(sf::Vector2f(cam.res.x, cam.res.y));
-    sf::RenderTexture texture;
-    texture.create(cam.res.x, cam.res.y);
-    std::cout << "\rWindow and texture created.   \n";
+    window.setActive(true);
+    std::cout << "\rWindow created.   \n";
+
+    // frames accumulate in float targets on the window's context
+    std::cout << "Loading shader...";
+    RealtimeShader shader(cam, bvh, depth, frame_samples);
+    std::cout << "\rShader loaded.   \n";
 
     std::cout << R"instructions(
 +-------------------------------+
@@ -261,6 +641,10 @@ void render_realtime(const Camera& camera, BVH& bvh, int depth, int frame_sample
 )instructions";
 
     int frame = 0;
+    // fps 0 is sfml's "no limit", and so no target for the controller either
+    FrameController controller(cam.res, fps > 0 ? 1000.0f / fps : 0, frame_samples);
+    Timer since_move;
+    since_move.start();
     const float rotate_angle = 5 * DEG2RAD;
     const float move_speed = 1;
     bool camera_changed = true;
@@ -340,13 +724,8 @@ void render_realtime(const Camera& camera, BVH& bvh, int depth, int frame_sample
                             std::string filename = dir / (std::to_string(frame) + ".png");
                             std::cout << "Saving screenshot to " << filename << '\n';
 
-                            auto window_size = window.getSize();
-                            sf::Texture screenshot;
-                            screenshot.create(window_size.x, window_size.y);
-                            screenshot.update(window);
-                            sf::Image image = screenshot.copyToImage();
-
-                            image.saveToFile(filename);
+                            // the linear mean, gamma corrected like any other render
+                            shader.read_image().save(filename);
                             break;
                         }
                         default:
@@ -358,30 +737,29 @@ void render_realtime(const Camera& camera, BVH& bvh, int depth, int frame_sample
             }
         }
 
-        shader.setUniform("frame", frame++);
-        shader.setUniform("prev_frame", texture.getTexture());
+        if (!window.isOpen()) break;
 
+        // a moved camera keeps the history, the next frame reprojects it
         if (camera_changed) {
-            sf_set_uniform(shader, cam);
-            texture.clear();
-            frame = 0;
+            shader.set_camera(cam);
             camera_changed = false;
+            since_move.reset();
         }
-        if (!accumulate) {
-            texture.clear();
-            frame = 0;
+        if (!accumulate) shader.reset();
+        if (adaptive) {
+            controller.next(since_move.seconds() < MOTION_HOLD);
+            controller.record(shader.render(frame++, controller.samples, controller.scale));
+        } else {
+            shader.render(frame++, frame_samples);
         }
 
-        texture.draw(rect, &shader);
-        texture.display();  // what does this even do?
-
         std::string title = "pos: " + std::to_string(cam.pos.x) + ", " +
                             std::to_string(cam.pos.y) + ", " + std::to_string(cam.pos.z) +
                             " | forward: " + std::to_string(cam.forward.x) + ", " +
                             std::to_string(cam.forward.y) + ", " + std::to_string(cam.forward.z);
         window.setTitle(title);
-        window.clear();
-        window.draw(sf::Sprite(texture.getTexture()));
+        sf::Vector2u size = window.getSize();
+        shader.display(ivec2(size.x, size.y));
         window.display();
     }
 }
\ No newline at end of file
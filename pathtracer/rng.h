@@ -29,4 +29,8 @@ struct lcg {
     unsigned long long min() const {
         return 0;
     }
-} rng(SEED);
+};
+
+// one generator per thread, so cpu render threads never share a state
+// every thread starts from SEED, threads that need their own stream reseed
+thread_local lcg rng(SEED);
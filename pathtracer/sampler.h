@@ -0,0 +1,143 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include "linalg.h"
+#include "rng.h"
+
+#define BLUE_NOISE_SIZE 64
+#define BLUE_NOISE_SIGMA 1.5f
+
+// screen space sampler for low sample counts
+// - each sample index is a point of a 4d rank-1 lattice (R4 sequence),
+//   so the samples of a single pixel are well stratified
+// - every pixel shifts the lattice by the value of a blue noise tile
+//   (cranley-patterson rotation), so the error of neighbouring pixels
+//   is decorrelated and shows up as high frequency noise
+struct BlueNoise {
+    enum Dimension {
+        PIXEL = 0,   // sub pixel jitter (x, y)
+        BOUNCE = 2,  // first bounce direction (u, v)
+    };
+
+    // lattice generators 1 / g^i for g^5 = g + 1, stored as 32 bit
+    // fixed point so that large sample indices do not lose precision
+    static constexpr std::array<unsigned int, 4> LATTICE = {
+        0xdb4f0b91u,
+        0xbbe05633u,
+        0xa0f2ec75u,
+        0x89e18285u,
+    };
+    // offset into the tile between dimensions
+    static constexpr int DIM_OFFSET_X = 23, DIM_OFFSET_Y = 41;
+
+    int size;
+    std::vector<float> values;  // rank of each texel mapped to [0, 1)
+
+    BlueNoise(int size = BLUE_NOISE_SIZE, unsigned int seed = SEED) : size(size) {
+        generate(seed);
+    }
+
+    float get(int x, int y) const {
+        return values[(y % size) * size + (x % size)];
+    }
+    float sample(int x, int y, unsigned int index, int dim) const {
+        float offset = get(x + dim * DIM_OFFSET_X, y + dim * DIM_OFFSET_Y);
+        float lattice = ((index * LATTICE[dim]) >> 8) / 16777216.0f;
+        float ret = offset + lattice;
+        return ret >= 1 ? ret - 1 : ret;
+    }
+    vec2 sample2d(int x, int y, unsigned int index, Dimension dim) const {
+        return vec2(sample(x, y, index, dim), sample(x, y, index, dim + 1));
+    }
+
+    void generate(unsigned int seed) {
+        // void and cluster (ulichney 1993) on a torus
+        int n = size * size;
+
+        // gaussian energy filter indexed by wrapped offset
+        std::vector<float> filter(n);
+        for (int dy = 0; dy < size; dy++) {
+            for (int dx = 0; dx < size; dx++) {
+                int x = std::min(dx, size - dx), y = std::min(dy, size - dy);
+                filter[dy * size + dx] =
+                    std::exp(-(x * x + y * y) / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+            }
+        }
+
+        std::vector<bool> pattern(n, false);
+        std::vector<float> energy(n, 0);
+        auto update = [&](std::vector<bool>& pattern, std::vector<float>& energy, int p, bool on) {
+            pattern[p] = on;
+            int px = p % size, py = p / size;
+            float sign = on ? 1 : -1;
+            for (int y = 0; y < size; y++) {
+                int row = ((y - py + size) % size) * size;
+                for (int x = 0; x < size; x++)
+                    energy[y * size + x] += sign * filter[row + (x - px + size) % size];
+            }
+        };
+        auto tightest_cluster = [&](const std::vector<bool>& pattern,
+                                    const std::vector<float>& energy) {
+            int ret = -1;
+            for (int i = 0; i < n; i++)
+                if (pattern[i] && (ret == -1 || energy[i] > energy[ret])) ret = i;
+            return ret;
+        };
+        auto largest_void = [&](const std::vector<bool>& pattern,
+                                const std::vector<float>& energy) {
+            int ret = -1;
+            for (int i = 0; i < n; i++)
+                if (!pattern[i] && (ret == -1 || energy[i] < energy[ret])) ret = i;
+            return ret;
+        };
+
+        // random initial pattern, separate generator to leave the global rng untouched
+        lcg gen(seed);
+        int ones = 0;
+        while (ones < n / 10) {
+            int p = gen() % n;
+            if (pattern[p]) continue;
+            update(pattern, energy, p, true);
+            ones++;
+        }
+
+        // spread out the initial pattern by moving the
+        // tightest cluster into the largest void
+        while (true) {
+            int cluster = tightest_cluster(pattern, energy);
+            update(pattern, energy, cluster, false);
+            int hole = largest_void(pattern, energy);
+            update(pattern, energy, hole, true);
+            if (hole == cluster) break;
+        }
+
+        std::vector<int> rank(n);
+
+        // rank the initial points by removing the tightest clusters
+        std::vector<bool> removed = pattern;
+        std::vector<float> removed_energy = energy;
+        for (int r = ones - 1; r >= 0; r--) {
+            int cluster = tightest_cluster(removed, removed_energy);
+            update(removed, removed_energy, cluster, false);
+            rank[cluster] = r;
+        }
+
+        // rank the remaining points by filling the largest voids
+        for (int r = ones; r < n; r++) {
+            int hole = largest_void(pattern, energy);
+            update(pattern, energy, hole, true);
+            rank[hole] = r;
+        }
+
+        values.resize(n);
+        for (int i = 0; i < n; i++) values[i] = (rank[i] + 0.5f) / n;
+    }
+};
+
+// shared tile, generated on first use
+const BlueNoise& blue_noise() {
+    static const BlueNoise noise;
+    return noise;
+}
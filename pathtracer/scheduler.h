@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+#include "linalg.h"
+
+#define GPU_CHUNK_LATENCY 50.0f  // milliseconds
+#define MIN_RENDER_SCALE 0.25f   // of the resolution, for realtime frames in motion
+#define MOTION_HOLD 0.2f         // seconds after a camera move that still count as motion
+
+// sizes gpu chunks from how long the previous one took, so every chunk takes
+// about target_ms: few dispatches without stalling the display or tripping
+// a driver watchdog
+// - chunks are handed out in bands of rows from the bottom, left to right
+// - a band is as tall as the budget allows for a full width chunk
+// - a chunk may at most double the pixels of the last one, so a jump from
+//   cheap to expensive parts of the image can't overshoot by much
+struct ChunkScheduler {
+    ivec2 res;
+    ivec2 first_chunk;
+    float target_ms;
+    double ms_per_pixel = 0;  // measured on the last chunk, 0 before the first
+    long long last_pixels = 0;
+    long long done_pixels = 0;
+    int chunks = 0;
+    int x = 0, y = 0;  // corner of the next chunk
+    int band_height = 1;
+
+    ChunkScheduler(const ivec2& res, const ivec2& first_chunk, float target_ms)
+        : res(res), first_chunk(component_max(first_chunk, ivec2(1))), target_ms(target_ms) {}
+
+    // start over at the first chunk for another pass over the image,
+    // keeping the timing of the last one
+    void restart() {
+        x = y = 0;
+        done_pixels = 0;
+    }
+
+    bool done() const {
+        return y >= res.y;
+    }
+    float progress() const {
+        return 100.0f * done_pixels / (float(res.x) * res.y);
+    }
+
+    // pixels the next chunk should cover
+    long long budget() const {
+        if (ms_per_pixel <= 0) return (long long)first_chunk.x * first_chunk.y;
+        long long pixels = static_cast<long long>(target_ms / ms_per_pixel);
+        return std::clamp(pixels, 1ll, 2 * last_pixels);
+    }
+    // next chunk as [top_left, bottom_right) in the same coordinates as draw_rect
+    void next(ivec2& top_left, ivec2& bottom_right) {
+        long long pixels = budget();
+        if (x == 0) {
+            int height;
+            if (ms_per_pixel <= 0)
+                height = first_chunk.y;
+            else if (pixels >= res.x)
+                height = static_cast<int>(pixels / res.x);
+            else
+                height = static_cast<int>(std::sqrt(double(pixels)));
+            band_height = std::clamp(height, 1, res.y - y);
+        }
+        long long width = std::clamp(pixels / band_height, 1ll, (long long)res.x - x);
+        top_left = ivec2(x, y);
+        bottom_right = ivec2(x + int(width), y + band_height);
+        x += width;
+        if (x >= res.x) {
+            x = 0;
+            y += band_height;
+        }
+    }
+    // time the chunk from next took on the gpu
+    void record(const ivec2& top_left, const ivec2& bottom_right, float ms) {
+        last_pixels = (long long)(bottom_right.x - top_left.x) * (bottom_right.y - top_left.y);
+        done_pixels += last_pixels;
+        ms_per_pixel = std::max(double(ms), 1e-6) / last_pixels;
+        chunks++;
+    }
+};
+
+// splits the rows of an image between the gpu and a pool of cpu threads: the gpu
+// takes bands from the bottom and the threads single rows from the top, so the two
+// meet wherever their measured throughputs put them
+// - gpu work is sized like ChunkScheduler's chunks, to about target_ms each
+// - a thread stops taking rows once the gpu could finish every row left before
+//   the thread would finish one more, so a slow thread never holds up the end
+struct HybridScheduler {
+    ivec2 res;
+    ivec2 first_chunk;
+    float target_ms;
+    std::mutex mutex;
+    int bottom = 0, top;  // rows [bottom, top) are left
+    double gpu_ms_per_pixel = 0;  // measured on the last gpu chunk, 0 before the first
+    double cpu_ms_per_row = 0;    // measured on the last cpu row, 0 before the first
+    long long last_pixels = 0;
+    int gpu_rows = 0, cpu_rows = 0;
+
+    HybridScheduler(const ivec2& res, const ivec2& first_chunk, float target_ms)
+        : res(res),
+          first_chunk(component_max(first_chunk, ivec2(1))),
+          target_ms(target_ms),
+          top(res.y) {}
+
+    float progress() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return 100.0f * (res.y - (top - bottom)) / res.y;
+    }
+
+    // pixels the next gpu draw should cover, target_ms 0 keeps every draw at first_chunk
+    long long gpu_budget() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (target_ms <= 0 || gpu_ms_per_pixel <= 0) {
+            return (long long)first_chunk.x * first_chunk.y;
+        }
+        long long pixels = static_cast<long long>(target_ms / gpu_ms_per_pixel);
+        return std::clamp(pixels, 1ll, 2 * last_pixels);
+    }
+    // up to rows rows from the bottom as [start, start + count), false once none are left
+    bool take_gpu(int rows, int& start, int& count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (bottom >= top) return false;
+        start = bottom;
+        count = std::min(std::max(rows, 1), top - bottom);
+        bottom += count;
+        gpu_rows += count;
+        return true;
+    }
+    // one row from the top, false once none are left or the gpu should take the rest
+    bool take_cpu(int& row) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (bottom >= top) return false;
+        double gpu_ms = double(top - bottom) * res.x * gpu_ms_per_pixel;
+        if (gpu_ms_per_pixel > 0 && cpu_ms_per_row > gpu_ms) return false;
+        row = --top;
+        cpu_rows++;
+        return true;
+    }
+    // time a gpu draw of pixels pixels took
+    void record_gpu(long long pixels, float ms) {
+        std::lock_guard<std::mutex> lock(mutex);
+        last_pixels = pixels;
+        gpu_ms_per_pixel = std::max(double(ms), 1e-6) / pixels;
+    }
+    // time one cpu thread took for a row
+    void record_cpu(float ms) {
+        std::lock_guard<std::mutex> lock(mutex);
+        cpu_ms_per_row = ms;
+    }
+};
+
+// picks the samples per pixel and the render scale of every realtime frame
+// from how fast the last frames went, so each takes about target_ms on the gpu
+// - the rate (pixel samples per millisecond) is averaged over the last few frames
+// - while the camera moves: 1 sample at the largest scale that fits, down to
+//   MIN_RENDER_SCALE
+// - while it holds still: full resolution, and samples may at most double from
+//   one frame to the next, so the view sharpens without a frame overshooting
+// - target_ms 0 (no frame rate limit) is no target: every frame takes max_samples
+//   at full resolution
+struct FrameController {
+    ivec2 res;
+    float target_ms;
+    int max_samples;
+    double rate = 0;  // 0 before the first frame
+    int samples = 1;
+    float scale = 1;
+
+    FrameController(const ivec2& res, float target_ms, int max_samples)
+        : res(res), target_ms(target_ms), max_samples(std::max(max_samples, 1)) {}
+
+    // settings for the next frame
+    void next(bool moving) {
+        if (target_ms <= 0) {
+            samples = max_samples;
+            scale = 1;
+            return;
+        }
+        if (rate <= 0) return;
+        double budget = target_ms * rate / (double(res.x) * res.y);
+        if (moving) {
+            samples = 1;
+            scale = std::clamp(float(std::sqrt(budget)), MIN_RENDER_SCALE, 1.0f);
+        } else {
+            scale = 1;
+            samples = std::clamp(int(budget), 1, std::min(2 * samples, max_samples));
+        }
+    }
+    // time the frame from next took
+    void record(float ms) {
+        double pixel_samples = samples * double(res.x * scale) * double(res.y * scale);
+        double measured = pixel_samples / std::max(double(ms), 1e-3);
+        rate = rate > 0 ? 0.75 * rate + 0.25 * measured : measured;
+    }
+};
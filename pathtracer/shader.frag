@@ -10,14 +10,41 @@ const float EPS = 1e-6f;
 
 #define MAX_DEPTH 20
 
-uniform int render_samples;
-uniform int render_depth;
-
 #ifdef REALTIME
-uniform int frame;
+// the mean of every frame so far in rgb, linear, and the number of samples behind it in alpha
 uniform sampler2D prev_frame;
+// first hit distance of the last frame, and the camera it was rendered with,
+// the camera is only read with reproject set
+uniform sampler2D prev_depth;
+uniform int reproject;
+uniform vec3 prev_pos;
+uniform mat4 prev_transform;
+uniform float prev_cell_size;
+uniform ivec2 prev_res;
+
+// history more than this many samples old is dropped when reprojected, so
+// blur from resampling it fades, and a first hit farther than the tolerance
+// (relative) from where the last frame saw it is a disocclusion
+const float REPROJECT_MAX_SAMPLES = 32.0;
+const float REPROJECT_TOLERANCE = 0.05;
+#endif
+
+layout(location = 0) out vec4 frag_color;
+#ifdef REALTIME
+layout(location = 1) out float frame_depth;
+#else
+// first hit buffers, only written if the framebuffer has attachments for them
+layout(location = 1) out vec4 aov_normal_depth;
+layout(location = 2) out vec4 aov_albedo_id;
 #endif
 
+// blue noise tile and R4 lattice, see BlueNoise in sampler.h
+uniform sampler2D blue_noise;
+const uint LATTICE[4] = uint[4](0xdb4f0b91u, 0xbbe05633u, 0xa0f2ec75u, 0x89e18285u);
+const ivec2 DIM_OFFSET = ivec2(23, 41);
+const int DIM_PIXEL = 0;
+const int DIM_BOUNCE = 2;
+
 struct Camera {
     vec3 pos;
     ivec2 res;
@@ -26,7 +53,15 @@ struct Camera {
     float image_distance;
     mat4 transform;
 };
-uniform Camera camera;
+// per render (or per frame) parameters, uploaded as one buffer
+// std140 offsets have to match RenderParams in shader.h
+layout(std140) uniform RenderParams {
+    Camera camera;
+    int render_samples;
+    int render_depth;
+    int frame; // realtime accumulation, 0 otherwise
+    int sample_offset; // samples taken by earlier passes (or frames)
+};
 
 const int EMIT = 1;
 const int DIFF = 2; // diffuse
@@ -43,16 +78,44 @@ struct Triangle {
     vec3 v1, v2, v3;
     Material material;
 };
+// see ThreadedNode in bvh.h
 struct BVHNode {
     AABB aabb;
-    int left, right;
-    int tri_start, tri_end;
+    int escape;
+    int tri_start, tri_end; // -1 for inner nodes
+};
+// what a camera ray sees at its first hit, see AOVSample in aov.h
+struct FirstHit {
+    vec3 normal, albedo;
+    float depth;
+    int tri; // -1 if the ray missed
 };
 
-#define MAX_TRIANGLES 300
-uniform Triangle triangles[MAX_TRIANGLES];
-uniform int tri_indices[MAX_TRIANGLES];
-uniform BVHNode bvh_nodes[MAX_TRIANGLES * 2];
+// scene packed into buffer textures, see SceneBuffers in shader.h
+// - triangles: 5 texels each, (v1, type) (v2, roughness) (v3, 0) (color, 0) (emit_color, 0)
+// - tri_indices: one int per triangle in bvh order
+// - bvh_nodes: threaded layout, 3 texels each, (lb, escape) (rt, tri_start) (tri_end, 0, 0, 0)
+//   with the ints stored as float bits
+uniform samplerBuffer triangles;
+uniform isamplerBuffer tri_indices;
+uniform samplerBuffer bvh_nodes;
+
+vec3 tri_vertex(int tri_idx, int v) {
+    return texelFetch(triangles, tri_idx * 5 + v).xyz;
+}
+Material load_material(int tri_idx) {
+    vec4 t0 = texelFetch(triangles, tri_idx * 5);
+    vec4 t1 = texelFetch(triangles, tri_idx * 5 + 1);
+    vec3 color = texelFetch(triangles, tri_idx * 5 + 3).xyz;
+    vec3 emit_color = texelFetch(triangles, tri_idx * 5 + 4).xyz;
+    return Material(int(t0.w), color, emit_color, t1.w);
+}
+BVHNode load_node(int node_idx) {
+    vec4 t0 = texelFetch(bvh_nodes, node_idx * 3);
+    vec4 t1 = texelFetch(bvh_nodes, node_idx * 3 + 1);
+    int tri_end = floatBitsToInt(texelFetch(bvh_nodes, node_idx * 3 + 2).x);
+    return BVHNode(AABB(t0.xyz, t1.xyz), floatBitsToInt(t0.w), floatBitsToInt(t1.w), tri_end);
+}
 
 float rand01(inout uint state) {
     state ^= 2747636419u;
@@ -65,10 +128,21 @@ float rand01(inout uint state) {
     return float(state) / 4294967295.0;
 }
 
+float blue_noise_sample(uint index, int dim) {
+    ivec2 size = textureSize(blue_noise, 0);
+    ivec2 p = (ivec2(gl_FragCoord.xy) + dim * DIM_OFFSET) % size;
+    float offset = texelFetch(blue_noise, p, 0).r;
+    float lattice = float((index * LATTICE[dim]) >> 8u) / 16777216.0;
+    return fract(offset + lattice);
+}
+vec2 blue_noise_sample2d(uint index, int dim) {
+    return vec2(blue_noise_sample(index, dim), blue_noise_sample(index, dim + 1));
+}
+
 bool i_tri(vec3 ray_o, vec3 ray_d, int tri_idx, out float t) {
-    vec3 v1 = triangles[tri_idx].v1;
-    vec3 v2 = triangles[tri_idx].v2;
-    vec3 v3 = triangles[tri_idx].v3;
+    vec3 v1 = tri_vertex(tri_idx, 0);
+    vec3 v2 = tri_vertex(tri_idx, 1);
+    vec3 v3 = tri_vertex(tri_idx, 2);
 
     vec3 edge1 = v2 - v1, edge2 = v3 - v1;
     vec3 h = cross(ray_d, edge2);
@@ -91,9 +165,9 @@ bool i_tri(vec3 ray_o, vec3 ray_d, int tri_idx, out float t) {
     return t > 0;
 }
 vec3 n_tri(vec3 ray_d, vec3 p, int tri_idx) {
-    vec3 v1 = triangles[tri_idx].v1;
-    vec3 v2 = triangles[tri_idx].v2;
-    vec3 v3 = triangles[tri_idx].v3;
+    vec3 v1 = tri_vertex(tri_idx, 0);
+    vec3 v2 = tri_vertex(tri_idx, 1);
+    vec3 v3 = tri_vertex(tri_idx, 2);
 
     vec3 edge1 = v2 - v1, edge2 = v3 - v1;
     vec3 n = normalize(cross(edge1, edge2));
@@ -123,43 +197,35 @@ bool i_aabb(vec3 ray_o, vec3 inv_ray_d, AABB abbb) {
 
     return tmin <= tmax;
 }
-bool is_leaf(int bvh_idx) {
-    return bvh_nodes[bvh_idx].left == -1; // && bvh_nodes[bvh_idx].right == -1;
-}
 int i_bvh(vec3 ray_o, vec3 ray_d, out float t) {
     // returns the index of the triangle
     // that intersects the ray
     // or -1 if no intersection
 
-    // stack based intersection algorithm
-    // to mimic recursion
-
-    int stack[MAX_TRIANGLES * 2];
-    int stack_ptr = 0;
-    stack[stack_ptr++] = 0;
-
+    // stackless walk over the threaded bvh: a hit inner node
+    // goes on to the next node, everything else to its escape
     vec3 inv_ray_d = 1 / ray_d;
     int ret = -1;
     float min_t = FLOAT_INF;
 
-    while (stack_ptr > 0) {
-        stack_ptr--;
-        int cur_idx = stack[stack_ptr];
-        if (!i_aabb(ray_o, inv_ray_d, bvh_nodes[cur_idx].aabb))
-            continue;
-        if (is_leaf(cur_idx)) {
-            int start = bvh_nodes[cur_idx].tri_start;
-            int end = bvh_nodes[cur_idx].tri_end;
-            for (int i = start; i <= end; i++) {
+    int node_count = textureSize(bvh_nodes) / 3;
+    int idx = 0;
+    while (idx < node_count) {
+        BVHNode cur = load_node(idx);
+        if (!i_aabb(ray_o, inv_ray_d, cur.aabb)) {
+            idx = cur.escape;
+        } else if (cur.tri_start != -1) {
+            for (int i = cur.tri_start; i <= cur.tri_end; i++) {
+                int tri_idx = texelFetch(tri_indices, i).r;
                 float t_;
-                if (i_tri(ray_o, ray_d, tri_indices[i], t_) && t_ < min_t) {
+                if (i_tri(ray_o, ray_d, tri_idx, t_) && t_ < min_t) {
                     min_t = t_;
-                    ret = tri_indices[i];
+                    ret = tri_idx;
                 }
             }
+            idx = cur.escape;
         } else {
-            stack[stack_ptr++] = bvh_nodes[cur_idx].left;
-            stack[stack_ptr++] = bvh_nodes[cur_idx].right;
+            idx++;
         }
     }
 
@@ -168,14 +234,12 @@ int i_bvh(vec3 ray_o, vec3 ray_d, out float t) {
     return ret;
 }
 
-vec3 reflect_d(vec3 ray_d, vec3 normal, int tri_id, inout uint seed) {
+vec3 reflect_d(vec3 ray_d, vec3 normal, Material material, vec2 rnd, inout uint seed) {
     // brdf for different materials
-    int type = triangles[tri_id].material.type;
-
-    if (type == SPEC) {
+    if (material.type == SPEC) {
         // specular with noise
         vec3 reflected = reflect(ray_d, normal);
-        float roughness = triangles[tri_id].material.roughness;
+        float roughness = material.roughness;
         vec3 ret;
         do {
             vec3 jitter = (vec3(rand01(seed), rand01(seed), rand01(seed)) - 0.5f) * roughness;
@@ -184,22 +248,34 @@ vec3 reflect_d(vec3 ray_d, vec3 normal, int tri_id, inout uint seed) {
         return ret;
     } else {
         // lambertian diffuse
-        float u = rand01(seed), v = rand01(seed);
-        float theta = acos(2 * u - 1) - PI_2;
-        float phi = 2 * PI * v;
-        vec3 sample = vec3(cos(theta) * cos(phi), cos(theta) * sin(phi), sin(theta));
-        return sign(dot(sample, normal)) * sample;
+        float theta = acos(2 * rnd.x - 1) - PI_2;
+        float phi = 2 * PI * rnd.y;
+        vec3 d = vec3(cos(theta) * cos(phi), cos(theta) * sin(phi), sin(theta));
+        return sign(dot(d, normal)) * d;
     }
 }
 
-vec3 trace(vec3 ray_o, vec3 ray_d, int depth, inout uint seed) {
+FirstHit normal_shade(vec3 ray_o, vec3 ray_d, int tri_id, float hit_t) {
+    // normal and albedo are already at hand at the first bounce,
+    // keeping them costs next to nothing
+    vec3 hit_n = n_tri(ray_d, ray_o + ray_d * hit_t, tri_id);
+    // lights keep their emission as is when demodulating
+    Material material = load_material(tri_id);
+    vec3 albedo = material.type == EMIT ? vec3(1) : material.color;
+    return FirstHit(hit_n, albedo, hit_t, tri_id);
+}
+
+vec3 trace(vec3 ray_o, vec3 ray_d, int depth, vec2 bounce, inout uint seed, out FirstHit first) {
     // stack based iteration
+    // bounce is used for the first bounce, the rest is random
+    // first receives what the camera ray hits
 
     struct TraceResult {
         vec3 color, emit;
         float theta;
     } stack[MAX_DEPTH + 1];
     int stack_ptr = 0;
+    first = FirstHit(vec3(0), vec3(0), 0, -1);
 
     for (int d = 0; d < depth; d++) {
         float hit_t = FLOAT_INF;
@@ -207,10 +283,13 @@ vec3 trace(vec3 ray_o, vec3 ray_d, int depth, inout uint seed) {
 
         if (best_i == -1)
             break;
+        if (d == 0)
+            first = normal_shade(ray_o, ray_d, best_i, hit_t);
 
-        vec3 color = triangles[best_i].material.color;
-        vec3 emit = triangles[best_i].material.emit_color;
-        if (triangles[best_i].material.type == EMIT) {
+        Material material = load_material(best_i);
+        vec3 color = material.color;
+        vec3 emit = material.emit_color;
+        if (material.type == EMIT) {
             stack[stack_ptr++] = TraceResult(color, emit, 0);
             break;
         }
@@ -220,7 +299,8 @@ vec3 trace(vec3 ray_o, vec3 ray_d, int depth, inout uint seed) {
         vec3 bias = hit_n * BIAS;
 
         ray_o = hit_p + bias;
-        ray_d = reflect_d(ray_d, hit_n, best_i, seed);
+        vec2 rnd = d == 0 ? bounce : vec2(rand01(seed), rand01(seed));
+        ray_d = reflect_d(ray_d, hit_n, material, rnd, seed);
         float theta = dot(hit_n, ray_d);
         stack[stack_ptr++] = TraceResult(color, emit, theta);
     }
@@ -234,51 +314,85 @@ vec3 trace(vec3 ray_o, vec3 ray_d, int depth, inout uint seed) {
     return color;
 }
 
-vec3 normal_shade(vec3 ray_o, vec3 ray_d) {
-    float hit_t = FLOAT_INF;
-    int best_i = i_bvh(ray_o, ray_d, hit_t);
-
-    if (best_i == -1)
-        return vec3(0);
-
-    vec3 hit_p = ray_o + ray_d * hit_t;
-    vec3 hit_n = n_tri(ray_d, hit_p, best_i);
-    return hit_n;
-}
-
-vec3 camera_ray(inout uint seed) {
-    float w = gl_FragCoord.x, h = gl_FragCoord.y;
-    vec2 jitter = vec2(rand01(seed), rand01(seed)) * camera.cell_size;
+vec3 camera_ray(vec2 rnd) {
+    float w = floor(gl_FragCoord.x), h = floor(gl_FragCoord.y);
+    vec2 jitter = rnd * camera.cell_size;
 
     vec3 ray_d = vec3(w * camera.cell_size - camera.v_res.x / 2 + jitter.x, h * camera.cell_size - camera.v_res.y / 2 + jitter.y, -camera.image_distance);
     ray_d = vec3(dot(ray_d, vec3(camera.transform[0][0], camera.transform[1][0], camera.transform[2][0])), dot(ray_d, vec3(camera.transform[0][1], camera.transform[1][1], camera.transform[2][1])), dot(ray_d, vec3(camera.transform[0][2], camera.transform[1][2], camera.transform[2][2])));
     return normalize(ray_d);
 }
+#ifdef REALTIME
+vec4 history(float depth) {
+    // the mean so far behind this pixel: the same texel while the view holds
+    // still, otherwise wherever the last frame's camera saw this pixel's first hit
+    if (reproject == 0)
+        return texelFetch(prev_frame, ivec2(gl_FragCoord.xy), 0);
+
+    // misses are far enough away that only the rotation moves them
+    vec3 ray_d = camera_ray(vec2(0.5));
+    vec3 hit_p = camera.pos + ray_d * (depth > 0 ? depth : 1e6);
+    vec3 local = inverse(mat3(prev_transform)) * (hit_p - prev_pos);
+    if (local.z >= 0)
+        return vec4(0);
+    vec2 image = local.xy * (camera.image_distance / -local.z);
+    vec2 pixel = (image + camera.v_res / 2) / prev_cell_size;
+    if (any(lessThan(pixel, vec2(0))) || any(greaterThanEqual(pixel, vec2(prev_res))))
+        return vec4(0);
+    // filtering stays clear of the texels past the last frame's resolution
+    pixel = clamp(pixel, vec2(0.5), vec2(prev_res) - 0.5);
+    vec2 pos = pixel / vec2(textureSize(prev_frame, 0));
+
+    float expected = depth > 0 ? length(hit_p - prev_pos) : 0;
+    float found = texture(prev_depth, pos).r;
+    if (abs(found - expected) > REPROJECT_TOLERANCE * expected + EPS)
+        return vec4(0);
+
+    // a sample from bigger pixels covers less of this one
+    vec4 prev = texture(prev_frame, pos);
+    float area = min(1.0, pow(camera.cell_size / prev_cell_size, 2));
+    prev.a = min(prev.a, REPROJECT_MAX_SAMPLES) * area;
+    return prev;
+}
+#endif
+
 void main() {
     // acts weird if seed = 0
     #ifdef REALTIME
     uint seed = uint(frame * gl_FragCoord.y + gl_FragCoord.x * camera.res.y + 1);
     #else
-    uint seed = uint(gl_FragCoord.y + gl_FragCoord.x * camera.res.y + 1);
+    uint seed = uint(gl_FragCoord.y + gl_FragCoord.x * camera.res.y + 1) + uint(sample_offset) * 2654435769u;
     #endif
 
-    vec3 cur_color = vec3(0);
+    vec3 cur_sum = vec3(0);
+    // normal, albedo and depth are averaged, the id comes from the first sample that hit
+    FirstHit first, aov = FirstHit(vec3(0), vec3(0), 0, -1);
     for (int i = 0; i < render_samples; i++) {
-        vec3 ray_d = camera_ray(seed);
-        vec3 color = trace(camera.pos, ray_d, render_depth, seed);
-        cur_color += color / render_samples;
+        uint index = uint(sample_offset + i);
+        vec3 ray_d = camera_ray(blue_noise_sample2d(index, DIM_PIXEL));
+        vec2 bounce = blue_noise_sample2d(index, DIM_BOUNCE);
+        vec3 color = trace(camera.pos, ray_d, render_depth, bounce, seed, first);
+        cur_sum += color;
+        aov.normal += first.normal / render_samples;
+        aov.albedo += first.albedo / render_samples;
+        aov.depth += first.depth / render_samples;
+        if (aov.tri == -1)
+            aov.tri = first.tri;
     }
 
-    // gamma correction
-    cur_color = pow(cur_color, vec3(1.0 / 2.2));
-
     #ifdef REALTIME
-    vec2 pos = gl_FragCoord.xy / camera.res.xy;
-    vec3 prev_color = texture(prev_frame, pos).rgb;
-
-    vec3 color = mix(prev_color, cur_color, 1 / float(frame + 1));
-    gl_FragColor = vec4(color, 1.0);
+    // fold this frame into the running mean, weighted by sample count,
+    // gamma correction is left to the display
+    vec4 prev = history(aov.depth);
+    float count = prev.a + float(render_samples);
+    vec3 color = mix(prev.rgb, cur_sum / float(render_samples), float(render_samples) / count);
+    frag_color = vec4(color, count);
+    frame_depth = aov.depth;
     #else
-    gl_FragColor = vec4(cur_color, 1.0);
+    // linear sum of this pass, added onto the float accumulation target by blending,
+    // alpha counts the samples so readback can normalize whatever passes ran
+    frag_color = vec4(cur_sum, float(render_samples));
+    aov_normal_depth = vec4(aov.normal, aov.depth);
+    aov_albedo_id = vec4(aov.albedo, float(aov.tri));
     #endif
 }
\ No newline at end of file
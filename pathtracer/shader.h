@@ -1,12 +1,22 @@
 #pragma once
 
 #include <GL/glew.h>
-#include <GLFW/glfw3.h>
 
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "aov.h"
 #include "bvh.h"
 #include "camera.h"
-#include "fpng.h"
+#include "context.h"
+#include "image.h"
 #include "linalg.h"
+#include "parallel.h"
+#include "program_cache.h"
+#include "sampler.h"
 
 // #define DEBUG
 
@@ -34,14 +44,41 @@ const float EPS = 1e-6f;
 
 #define MAX_DEPTH 20
 
-uniform int render_samples;
-uniform int render_depth;
-
 #ifdef REALTIME
-uniform int frame;
+// the mean of every frame so far in rgb, linear, and the number of samples behind it in alpha
 uniform sampler2D prev_frame;
+// first hit distance of the last frame, and the camera it was rendered with,
+// the camera is only read with reproject set
+uniform sampler2D prev_depth;
+uniform int reproject;
+uniform vec3 prev_pos;
+uniform mat4 prev_transform;
+uniform float prev_cell_size;
+uniform ivec2 prev_res;
+
+// history more than this many samples old is dropped when reprojected, so
+// blur from resampling it fades, and a first hit farther than the tolerance
+// (relative) from where the last frame saw it is a disocclusion
+const float REPROJECT_MAX_SAMPLES = 32.0;
+const float REPROJECT_TOLERANCE = 0.05;
+#endif
+
+layout(location = 0) out vec4 frag_color;
+#ifdef REALTIME
+layout(location = 1) out float frame_depth;
+#else
+// first hit buffers, only written if the framebuffer has attachments for them
+layout(location = 1) out vec4 aov_normal_depth;
+layout(location = 2) out vec4 aov_albedo_id;
 #endif
 
+// blue noise tile and R4 lattice, see BlueNoise in sampler.h
+uniform sampler2D blue_noise;
+const uint LATTICE[4] = uint[4](0xdb4f0b91u, 0xbbe05633u, 0xa0f2ec75u, 0x89e18285u);
+const ivec2 DIM_OFFSET = ivec2(23, 41);
+const int DIM_PIXEL = 0;
+const int DIM_BOUNCE = 2;
+
 struct Camera {
     vec3 pos;
     ivec2 res;
@@ -50,7 +87,15 @@ struct Camera {
     float image_distance;
     mat4 transform;
 };
-uniform Camera camera;
+// per render (or per frame) parameters, uploaded as one buffer
+// std140 offsets have to match RenderParams in shader.h
+layout(std140) uniform RenderParams {
+    Camera camera;
+    int render_samples;
+    int render_depth;
+    int frame; // realtime accumulation, 0 otherwise
+    int sample_offset; // samples taken by earlier passes (or frames)
+};
 
 const int EMIT = 1;
 const int DIFF = 2; // diffuse
@@ -67,16 +112,44 @@ struct Triangle {
     vec3 v1, v2, v3;
     Material material;
 };
+// see ThreadedNode in bvh.h
 struct BVHNode {
     AABB aabb;
-    int left, right;
-    int tri_start, tri_end;
+    int escape;
+    int tri_start, tri_end; // -1 for inner nodes
+};
+// what a camera ray sees at its first hit, see AOVSample in aov.h
+struct FirstHit {
+    vec3 normal, albedo;
+    float depth;
+    int tri; // -1 if the ray missed
 };
 
-#define MAX_TRIANGLES 300
-uniform Triangle triangles[MAX_TRIANGLES];
-uniform int tri_indices[MAX_TRIANGLES];
-uniform BVHNode bvh_nodes[MAX_TRIANGLES * 2];
+// scene packed into buffer textures, see SceneBuffers in shader.h
+// - triangles: 5 texels each, (v1, type) (v2, roughness) (v3, 0) (color, 0) (emit_color, 0)
+// - tri_indices: one int per triangle in bvh order
+// - bvh_nodes: threaded layout, 3 texels each, (lb, escape) (rt, tri_start) (tri_end, 0, 0, 0)
+//   with the ints stored as float bits
+uniform samplerBuffer triangles;
+uniform isamplerBuffer tri_indices;
+uniform samplerBuffer bvh_nodes;
+
+vec3 tri_vertex(int tri_idx, int v) {
+    return texelFetch(triangles, tri_idx * 5 + v).xyz;
+}
+Material load_material(int tri_idx) {
+    vec4 t0 = texelFetch(triangles, tri_idx * 5);
+    vec4 t1 = texelFetch(triangles, tri_idx * 5 + 1);
+    vec3 color = texelFetch(triangles, tri_idx * 5 + 3).xyz;
+    vec3 emit_color = texelFetch(triangles, tri_idx * 5 + 4).xyz;
+    return Material(int(t0.w), color, emit_color, t1.w);
+}
+BVHNode load_node(int node_idx) {
+    vec4 t0 = texelFetch(bvh_nodes, node_idx * 3);
+    vec4 t1 = texelFetch(bvh_nodes, node_idx * 3 + 1);
+    int tri_end = floatBitsToInt(texelFetch(bvh_nodes, node_idx * 3 + 2).x);
+    return BVHNode(AABB(t0.xyz, t1.xyz), floatBitsToInt(t0.w), floatBitsToInt(t1.w), tri_end);
+}
 
 float rand01(inout uint state) {
     state ^= 2747636419u;
@@ -89,10 +162,21 @@ float rand01(inout uint state) {
     return float(state) / 4294967295.0;
 }
 
+float blue_noise_sample(uint index, int dim) {
+    ivec2 size = textureSize(blue_noise, 0);
+    ivec2 p = (ivec2(gl_FragCoord.xy) + dim * DIM_OFFSET) % size;
+    float offset = texelFetch(blue_noise, p, 0).r;
+    float lattice = float((index * LATTICE[dim]) >> 8u) / 16777216.0;
+    return fract(offset + lattice);
+}
+vec2 blue_noise_sample2d(uint index, int dim) {
+    return vec2(blue_noise_sample(index, dim), blue_noise_sample(index, dim + 1));
+}
+
 bool i_tri(vec3 ray_o, vec3 ray_d, int tri_idx, out float t) {
-    vec3 v1 = triangles[tri_idx].v1;
-    vec3 v2 = triangles[tri_idx].v2;
-    vec3 v3 = triangles[tri_idx].v3;
+    vec3 v1 = tri_vertex(tri_idx, 0);
+    vec3 v2 = tri_vertex(tri_idx, 1);
+    vec3 v3 = tri_vertex(tri_idx, 2);
 
     vec3 edge1 = v2 - v1, edge2 = v3 - v1;
     vec3 h = cross(ray_d, edge2);
@@ -115,9 +199,9 @@ bool i_tri(vec3 ray_o, vec3 ray_d, int tri_idx, out float t) {
     return t > 0;
 }
 vec3 n_tri(vec3 ray_d, vec3 p, int tri_idx) {
-    vec3 v1 = triangles[tri_idx].v1;
-    vec3 v2 = triangles[tri_idx].v2;
-    vec3 v3 = triangles[tri_idx].v3;
+    vec3 v1 = tri_vertex(tri_idx, 0);
+    vec3 v2 = tri_vertex(tri_idx, 1);
+    vec3 v3 = tri_vertex(tri_idx, 2);
 
     vec3 edge1 = v2 - v1, edge2 = v3 - v1;
     vec3 n = normalize(cross(edge1, edge2));
@@ -147,43 +231,35 @@ bool i_aabb(vec3 ray_o, vec3 inv_ray_d, AABB abbb) {
 
     return tmin <= tmax;
 }
-bool is_leaf(int bvh_idx) {
-    return bvh_nodes[bvh_idx].left == -1; // && bvh_nodes[bvh_idx].right == -1;
-}
 int i_bvh(vec3 ray_o, vec3 ray_d, out float t) {
     // returns the index of the triangle
     // that intersects the ray
     // or -1 if no intersection
 
-    // stack based intersection algorithm
-    // to mimic recursion
-
-    int stack[MAX_TRIANGLES * 2];
-    int stack_ptr = 0;
-    stack[stack_ptr++] = 0;
-
+    // stackless walk over the threaded bvh: a hit inner node
+    // goes on to the next node, everything else to its escape
     vec3 inv_ray_d = 1 / ray_d;
     int ret = -1;
     float min_t = FLOAT_INF;
 
-    while (stack_ptr > 0) {
-        stack_ptr--;
-        int cur_idx = stack[stack_ptr];
-        if (!i_aabb(ray_o, inv_ray_d, bvh_nodes[cur_idx].aabb))
-            continue;
-        if (is_leaf(cur_idx)) {
-            int start = bvh_nodes[cur_idx].tri_start;
-            int end = bvh_nodes[cur_idx].tri_end;
-            for (int i = start; i <= end; i++) {
+    int node_count = textureSize(bvh_nodes) / 3;
+    int idx = 0;
+    while (idx < node_count) {
+        BVHNode cur = load_node(idx);
+        if (!i_aabb(ray_o, inv_ray_d, cur.aabb)) {
+            idx = cur.escape;
+        } else if (cur.tri_start != -1) {
+            for (int i = cur.tri_start; i <= cur.tri_end; i++) {
+                int tri_idx = texelFetch(tri_indices, i).r;
                 float t_;
-                if (i_tri(ray_o, ray_d, tri_indices[i], t_) && t_ < min_t) {
+                if (i_tri(ray_o, ray_d, tri_idx, t_) && t_ < min_t) {
                     min_t = t_;
-                    ret = tri_indices[i];
+                    ret = tri_idx;
                 }
             }
+            idx = cur.escape;
         } else {
-            stack[stack_ptr++] = bvh_nodes[cur_idx].left;
-            stack[stack_ptr++] = bvh_nodes[cur_idx].right;
+            idx++;
         }
     }
 
@@ -192,14 +268,12 @@ int i_bvh(vec3 ray_o, vec3 ray_d, out float t) {
     return ret;
 }
 
-vec3 reflect_d(vec3 ray_d, vec3 normal, int tri_id, inout uint seed) {
+vec3 reflect_d(vec3 ray_d, vec3 normal, Material material, vec2 rnd, inout uint seed) {
     // brdf for different materials
-    int type = triangles[tri_id].material.type;
-
-    if (type == SPEC) {
+    if (material.type == SPEC) {
         // specular with noise
         vec3 reflected = reflect(ray_d, normal);
-        float roughness = triangles[tri_id].material.roughness;
+        float roughness = material.roughness;
         vec3 ret;
         do {
             vec3 jitter = (vec3(rand01(seed), rand01(seed), rand01(seed)) - 0.5f) * roughness;
@@ -208,22 +282,34 @@ vec3 reflect_d(vec3 ray_d, vec3 normal, int tri_id, inout uint seed) {
         return ret;
     } else {
         // lambertian diffuse
-        float u = rand01(seed), v = rand01(seed);
-        float theta = acos(2 * u - 1) - PI_2;
-        float phi = 2 * PI * v;
-        vec3 sample = vec3(cos(theta) * cos(phi), cos(theta) * sin(phi), sin(theta));
-        return sign(dot(sample, normal)) * sample;
+        float theta = acos(2 * rnd.x - 1) - PI_2;
+        float phi = 2 * PI * rnd.y;
+        vec3 d = vec3(cos(theta) * cos(phi), cos(theta) * sin(phi), sin(theta));
+        return sign(dot(d, normal)) * d;
     }
 }
 
-vec3 trace(vec3 ray_o, vec3 ray_d, int depth, inout uint seed) {
+FirstHit normal_shade(vec3 ray_o, vec3 ray_d, int tri_id, float hit_t) {
+    // normal and albedo are already at hand at the first bounce,
+    // keeping them costs next to nothing
+    vec3 hit_n = n_tri(ray_d, ray_o + ray_d * hit_t, tri_id);
+    // lights keep their emission as is when demodulating
+    Material material = load_material(tri_id);
+    vec3 albedo = material.type == EMIT ? vec3(1) : material.color;
+    return FirstHit(hit_n, albedo, hit_t, tri_id);
+}
+
+vec3 trace(vec3 ray_o, vec3 ray_d, int depth, vec2 bounce, inout uint seed, out FirstHit first) {
     // stack based iteration
+    // bounce is used for the first bounce, the rest is random
+    // first receives what the camera ray hits
 
     struct TraceResult {
         vec3 color, emit;
         float theta;
     } stack[MAX_DEPTH + 1];
     int stack_ptr = 0;
+    first = FirstHit(vec3(0), vec3(0), 0, -1);
 
     for (int d = 0; d < depth; d++) {
         float hit_t = FLOAT_INF;
@@ -231,10 +317,13 @@ vec3 trace(vec3 ray_o, vec3 ray_d, int depth, inout uint seed) {
 
         if (best_i == -1)
             break;
+        if (d == 0)
+            first = normal_shade(ray_o, ray_d, best_i, hit_t);
 
-        vec3 color = triangles[best_i].material.color;
-        vec3 emit = triangles[best_i].material.emit_color;
-        if (triangles[best_i].material.type == EMIT) {
+        Material material = load_material(best_i);
+        vec3 color = material.color;
+        vec3 emit = material.emit_color;
+        if (material.type == EMIT) {
             stack[stack_ptr++] = TraceResult(color, emit, 0);
             break;
         }
@@ -244,7 +333,8 @@ vec3 trace(vec3 ray_o, vec3 ray_d, int depth, inout uint seed) {
         vec3 bias = hit_n * BIAS;
 
         ray_o = hit_p + bias;
-        ray_d = reflect_d(ray_d, hit_n, best_i, seed);
+        vec2 rnd = d == 0 ? bounce : vec2(rand01(seed), rand01(seed));
+        ray_d = reflect_d(ray_d, hit_n, material, rnd, seed);
         float theta = dot(hit_n, ray_d);
         stack[stack_ptr++] = TraceResult(color, emit, theta);
     }
@@ -258,56 +348,271 @@ vec3 trace(vec3 ray_o, vec3 ray_d, int depth, inout uint seed) {
     return color;
 }
 
-vec3 normal_shade(vec3 ray_o, vec3 ray_d) {
-    float hit_t = FLOAT_INF;
-    int best_i = i_bvh(ray_o, ray_d, hit_t);
-
-    if (best_i == -1)
-        return vec3(0);
-
-    vec3 hit_p = ray_o + ray_d * hit_t;
-    vec3 hit_n = n_tri(ray_d, hit_p, best_i);
-    return hit_n;
-}
-
-vec3 camera_ray(inout uint seed) {
-    float w = gl_FragCoord.x, h = gl_FragCoord.y;
-    vec2 jitter = vec2(rand01(seed), rand01(seed)) * camera.cell_size;
+vec3 camera_ray(vec2 rnd) {
+    float w = floor(gl_FragCoord.x), h = floor(gl_FragCoord.y);
+    vec2 jitter = rnd * camera.cell_size;
 
     vec3 ray_d = vec3(w * camera.cell_size - camera.v_res.x / 2 + jitter.x, h * camera.cell_size - camera.v_res.y / 2 + jitter.y, -camera.image_distance);
     ray_d = vec3(dot(ray_d, vec3(camera.transform[0][0], camera.transform[1][0], camera.transform[2][0])), dot(ray_d, vec3(camera.transform[0][1], camera.transform[1][1], camera.transform[2][1])), dot(ray_d, vec3(camera.transform[0][2], camera.transform[1][2], camera.transform[2][2])));
     return normalize(ray_d);
 }
+#ifdef REALTIME
+vec4 history(float depth) {
+    // the mean so far behind this pixel: the same texel while the view holds
+    // still, otherwise wherever the last frame's camera saw this pixel's first hit
+    if (reproject == 0)
+        return texelFetch(prev_frame, ivec2(gl_FragCoord.xy), 0);
+
+    // misses are far enough away that only the rotation moves them
+    vec3 ray_d = camera_ray(vec2(0.5));
+    vec3 hit_p = camera.pos + ray_d * (depth > 0 ? depth : 1e6);
+    vec3 local = inverse(mat3(prev_transform)) * (hit_p - prev_pos);
+    if (local.z >= 0)
+        return vec4(0);
+    vec2 image = local.xy * (camera.image_distance / -local.z);
+    vec2 pixel = (image + camera.v_res / 2) / prev_cell_size;
+    if (any(lessThan(pixel, vec2(0))) || any(greaterThanEqual(pixel, vec2(prev_res))))
+        return vec4(0);
+    // filtering stays clear of the texels past the last frame's resolution
+    pixel = clamp(pixel, vec2(0.5), vec2(prev_res) - 0.5);
+    vec2 pos = pixel / vec2(textureSize(prev_frame, 0));
+
+    float expected = depth > 0 ? length(hit_p - prev_pos) : 0;
+    float found = texture(prev_depth, pos).r;
+    if (abs(found - expected) > REPROJECT_TOLERANCE * expected + EPS)
+        return vec4(0);
+
+    // a sample from bigger pixels covers less of this one
+    vec4 prev = texture(prev_frame, pos);
+    float area = min(1.0, pow(camera.cell_size / prev_cell_size, 2));
+    prev.a = min(prev.a, REPROJECT_MAX_SAMPLES) * area;
+    return prev;
+}
+#endif
+
 void main() {
     // acts weird if seed = 0
     #ifdef REALTIME
     uint seed = uint(frame * gl_FragCoord.y + gl_FragCoord.x * camera.res.y + 1);
     #else
-    uint seed = uint(gl_FragCoord.y + gl_FragCoord.x * camera.res.y + 1);
+    uint seed = uint(gl_FragCoord.y + gl_FragCoord.x * camera.res.y + 1) + uint(sample_offset) * 2654435769u;
     #endif
 
-    vec3 cur_color = vec3(0);
+    vec3 cur_sum = vec3(0);
+    // normal, albedo and depth are averaged, the id comes from the first sample that hit
+    FirstHit first, aov = FirstHit(vec3(0), vec3(0), 0, -1);
     for (int i = 0; i < render_samples; i++) {
-        vec3 ray_d = camera_ray(seed);
-        vec3 color = trace(camera.pos, ray_d, render_depth, seed);
-        cur_color += color / render_samples;
+        uint index = uint(sample_offset + i);
+        vec3 ray_d = camera_ray(blue_noise_sample2d(index, DIM_PIXEL));
+        vec2 bounce = blue_noise_sample2d(index, DIM_BOUNCE);
+        vec3 color = trace(camera.pos, ray_d, render_depth, bounce, seed, first);
+        cur_sum += color;
+        aov.normal += first.normal / render_samples;
+        aov.albedo += first.albedo / render_samples;
+        aov.depth += first.depth / render_samples;
+        if (aov.tri == -1)
+            aov.tri = first.tri;
     }
 
-    // gamma correction
-    cur_color = pow(cur_color, vec3(1.0 / 2.2));
-
     #ifdef REALTIME
-    vec2 pos = gl_FragCoord.xy / camera.res.xy;
-    vec3 prev_color = texture(prev_frame, pos).rgb;
-
-    vec3 color = mix(prev_color, cur_color, 1 / float(frame + 1));
-    gl_FragColor = vec4(color, 1.0);
+    // fold this frame into the running mean, weighted by sample count,
+    // gamma correction is left to the display
+    vec4 prev = history(aov.depth);
+    float count = prev.a + float(render_samples);
+    vec3 color = mix(prev.rgb, cur_sum / float(render_samples), float(render_samples) / count);
+    frag_color = vec4(color, count);
+    frame_depth = aov.depth;
     #else
-    gl_FragColor = vec4(cur_color, 1.0);
+    // linear sum of this pass, added onto the float accumulation target by blending,
+    // alpha counts the samples so readback can normalize whatever passes ran
+    frag_color = vec4(cur_sum, float(render_samples));
+    aov_normal_depth = vec4(aov.normal, aov.depth);
+    aov_albedo_id = vec4(aov.albedo, float(aov.tri));
     #endif
 }
 )glsl";
 
+#define SCENE_TEXTURE_UNIT 4  // first of three, clear of the units sfml hands out
+
+// the scene packed into buffer textures for FRAG_SOURCE, one upload call per buffer
+// - triangles: 5 rgba texels each, (v1, type) (v2, roughness) (v3, 0) (color, 0) (emit_color, 0)
+// - tri_indices: one int per triangle in bvh order
+// - bvh_nodes: the threaded layout, 3 rgba texels each,
+//   (lb, escape) (rt, tri_start) (tri_end, 0, 0, 0) with the ints stored as float bits
+struct SceneBuffers {
+    GLuint buffers[3] = {0, 0, 0};
+    GLuint textures[3] = {0, 0, 0};
+
+    SceneBuffers() = default;
+    SceneBuffers(const SceneBuffers&) = delete;
+    SceneBuffers& operator=(const SceneBuffers&) = delete;
+    ~SceneBuffers() {
+        release();
+    }
+    void release() {
+        // has to run while the context is still alive
+        if (!buffers[0]) return;
+        glDeleteTextures(3, textures);
+        glDeleteBuffers(3, buffers);
+        std::fill(buffers, buffers + 3, 0);
+        std::fill(textures, textures + 3, 0);
+    }
+
+    static float int_bits(int i) {
+        float f;
+        std::memcpy(&f, &i, sizeof(f));
+        return f;
+    }
+    bool upload(const BVH& bvh) {
+        GLint max_texels;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+        if (bvh.triangles.size() * 5 > size_t(max_texels) ||
+            bvh.threaded.size() * 3 > size_t(max_texels)) {
+            std::cerr << "Scene too large for the shader: " << bvh.triangles.size()
+                      << " triangles\n";
+            return false;
+        }
+
+        std::vector<float> triangles, nodes;
+        triangles.reserve(bvh.triangles.size() * 20);
+        nodes.reserve(bvh.threaded.size() * 12);
+        auto texel = [](std::vector<float>& out, const vec3& v, float w) {
+            out.insert(out.end(), {v.x, v.y, v.z, w});
+        };
+        for (const Triangle& tri : bvh.triangles) {
+            texel(triangles, tri.v1, float(tri.material.type));
+            texel(triangles, tri.v2, tri.material.roughness);
+            texel(triangles, tri.v3, 0);
+            texel(triangles, tri.material.color, 0);
+            texel(triangles, tri.material.emit_color, 0);
+        }
+        for (const ThreadedNode& node : bvh.threaded) {
+            texel(nodes, node.aabb.lb, int_bits(node.escape));
+            texel(nodes, node.aabb.rt, int_bits(node.tri_start));
+            texel(nodes, vec3(int_bits(node.tri_end), 0, 0), 0);
+        }
+
+        if (!buffers[0]) {
+            glGenBuffers(3, buffers);
+            glGenTextures(3, textures);
+        }
+        const void* data[3] = {triangles.data(), bvh.tri_idx.data(), nodes.data()};
+        const size_t bytes[3] = {triangles.size() * sizeof(float),
+                                 bvh.tri_idx.size() * sizeof(int), nodes.size() * sizeof(float)};
+        const GLenum formats[3] = {GL_RGBA32F, GL_R32I, GL_RGBA32F};
+        for (int i = 0; i < 3; i++) {
+            glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+            glBufferData(GL_TEXTURE_BUFFER, bytes[i], data[i], GL_STATIC_DRAW);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+            glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        bind();
+        return true;
+    }
+    // texture bindings are per context, bind on the one that draws
+    void bind() const {
+        for (int i = 0; i < 3; i++) {
+            glActiveTexture(GL_TEXTURE0 + SCENE_TEXTURE_UNIT + i);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+        }
+        glActiveTexture(GL_TEXTURE0);
+    }
+};
+
+#define PARAMS_BINDING 0  // uniform buffer binding point of RenderParams
+
+// host image of the std140 RenderParams block in FRAG_SOURCE
+struct RenderParams {
+    vec3 camera_pos;
+    float pad0;
+    ivec2 camera_res;
+    vec2 camera_v_res;
+    float camera_cell_size;
+    float camera_image_distance;
+    float pad1[2];
+    std::array<float, 16> camera_transform;
+    int render_samples;
+    int render_depth;
+    int frame;
+    int sample_offset;
+
+    void set_camera(const Camera& camera) {
+        camera_pos = camera.pos;
+        camera_res = camera.res;
+        camera_v_res = camera.v_res;
+        camera_cell_size = camera.cell_size;
+        camera_image_distance = camera.distance;
+        camera_transform = camera.transform;
+    }
+};
+static_assert(offsetof(RenderParams, camera_res) == 16, "RenderParams must match std140");
+static_assert(offsetof(RenderParams, camera_transform) == 48, "RenderParams must match std140");
+static_assert(offsetof(RenderParams, render_samples) == 112, "RenderParams must match std140");
+
+// uniform buffer behind the RenderParams block, every change
+// to the parameters is a single glBufferSubData
+struct ParamsBuffer {
+    GLuint ubo = 0;
+    RenderParams params = {};
+
+    ParamsBuffer() = default;
+    ParamsBuffer(const ParamsBuffer&) = delete;
+    ParamsBuffer& operator=(const ParamsBuffer&) = delete;
+    ~ParamsBuffer() {
+        release();
+    }
+    void release() {
+        // has to run while the context is still alive
+        if (!ubo) return;
+        glDeleteBuffers(1, &ubo);
+        ubo = 0;
+    }
+
+    bool create(GLuint program) {
+        GLuint index = glGetUniformBlockIndex(program, "RenderParams");
+        if (index == GL_INVALID_INDEX) {
+            std::cerr << "Shader has no RenderParams block\n";
+            return false;
+        }
+        glUniformBlockBinding(program, index, PARAMS_BINDING);
+        glGenBuffers(1, &ubo);
+        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(RenderParams), &params, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        bind();
+        return true;
+    }
+    void upload() {
+        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(RenderParams), &params);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+    // buffer bindings are per context, bind on the one that draws
+    void bind() const {
+        glBindBufferBase(GL_UNIFORM_BUFFER, PARAMS_BINDING, ubo);
+    }
+};
+
+// milliseconds the gpu spent on whatever draw issues, waits for it to finish
+template <typename F>
+float timed_draw(GLuint query, const F& draw) {
+    auto start = std::chrono::steady_clock::now();
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    draw();
+    glEndQuery(GL_TIME_ELAPSED);
+    glFinish();
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+    std::chrono::duration<float, std::milli> wall = std::chrono::steady_clock::now() - start;
+
+    // with the wait, most of the wall time should be gpu time, software
+    // rasterizers report nonsense (llvmpipe only times the setup),
+    // fall back to the wall time whenever the two disagree
+    float gpu = ns / 1e6f;
+    return gpu > 0.5f * wall.count() && gpu <= wall.count() ? gpu : wall.count();
+}
+
 #ifdef DEBUG
 const char* test_frag_source = R"glsl(
 #version 330 core
@@ -322,15 +627,23 @@ void main() {
 struct PathtraceShader {
     // renders a scene to an image
 
-    GLFWwindow* window;
+    GLContext gl;
     ivec2 resolution;
     GLuint texture;
+    GLuint noise_texture;
+    GLuint aov_textures[2] = {0, 0};  // normal and depth, albedo and triangle id
     GLuint fbo;
-    GLuint vert_shader, frag_shader, shader;
-    GLuint vao, vbo, ebo;
-
-    PathtraceShader(const Camera& camera, BVH& bvh, int samples, int depth) {
-        bool success = init_gl(camera.res);
+    GLuint shader;
+    GLuint vao, vbo;  // fullscreen quad, chunks are cut out with the scissor
+    GLuint timer_query;
+    GLuint pbo = 0;  // readback target, see start_readback
+    GLsync readback_fence = 0;
+    SceneBuffers scene;
+    ParamsBuffer params;
+    std::unordered_map<std::string, GLint> locations;
+
+    PathtraceShader(const Camera& camera, BVH& bvh, int samples, int depth, bool aovs = false) {
+        bool success = init_gl(camera.res) && (!aovs || init_aovs());
         if (!success) throw std::runtime_error("Failed to initialize PathtraceShader");
 
         if (!bvh.built) {
@@ -338,25 +651,38 @@ struct PathtraceShader {
             bvh.build();
         }
 
+        if (!params.create(shader)) throw std::runtime_error("Failed to create RenderParams");
+        if (!set_bvh(bvh)) throw std::runtime_error("Failed to upload scene to PathtraceShader");
+        set_blue_noise(blue_noise());
+        params.params.render_samples = samples;
+        params.params.render_depth = depth;
         set_camera(camera);
-        set_bvh(bvh);
-        set_uniform("render_samples", samples);
-        set_uniform("render_depth", depth);
+        reset();
     }
     ~PathtraceShader() {
         glDeleteTextures(1, &texture);
+        glDeleteTextures(1, &noise_texture);
+        glDeleteTextures(2, aov_textures);
         glDeleteFramebuffers(1, &fbo);
-        glDeleteShader(vert_shader);
-        glDeleteShader(frag_shader);
         glDeleteProgram(shader);
         glDeleteVertexArrays(1, &vao);
         glDeleteBuffers(1, &vbo);
-        glDeleteBuffers(1, &ebo);
-        glfwTerminate();
+        glDeleteQueries(1, &timer_query);
+        glDeleteBuffers(1, &pbo);
+        if (readback_fence) glDeleteSync(readback_fence);
+        scene.release();
+        params.release();
+    }
+
+    // locations are looked up once per name
+    GLint loc(const std::string& name) {
+        auto it = locations.find(name);
+        if (it == locations.end())
+            it = locations.emplace(name, glGetUniformLocation(shader, name.c_str())).first;
+        return it->second;
     }
 
-// uniform wrapper functions
-#define loc(name) glGetUniformLocation(shader, name.c_str())
+    // uniform wrapper functions
     void set_uniform(const std::string& name, int value) {
         glUniform1i(loc(name), value);
     }
@@ -375,83 +701,43 @@ struct PathtraceShader {
     void set_uniform(const std::string& name, const std::array<float, 16>& value) {
         glUniformMatrix4fv(loc(name), 1, GL_FALSE, value.data());
     }
-#undef loc
 
     void set_camera(const Camera& camera) {
-        set_uniform("camera.pos", camera.pos);
-        set_uniform("camera.res", camera.res);
-        set_uniform("camera.v_res", camera.v_res);
-        set_uniform("camera.cell_size", camera.cell_size);
-        set_uniform("camera.image_distance", camera.distance);
-        set_uniform("camera.transform", camera.transform);
-    }
-    void set_bvh(const BVH& bvh) {
-        // set triangle indices
-        for (size_t i = 0; i < bvh.tri_idx.size(); i++) {
-            std::string name = "tri_indices[" + std::to_string(i) + "]";
-            set_uniform(name, bvh.tri_idx[i]);
-        }
-
-        // set triangles
-        for (size_t i = 0; i < bvh.triangles.size(); i++) {
-            const Triangle& tri = bvh.triangles[i];
-            std::string name = "triangles[" + std::to_string(i) + "].";
-            set_uniform(name + "v1", tri.v1);
-            set_uniform(name + "v2", tri.v2);
-            set_uniform(name + "v3", tri.v3);
-
-            name += "material.";
-            set_uniform(name + "type", tri.material.type);
-            set_uniform(name + "color", tri.material.color);
-            set_uniform(name + "emit_color", tri.material.emit_color);
-            set_uniform(name + "roughness", tri.material.roughness);
-        }
-
-        // set bvh nodes
-        for (size_t i = 0; i < bvh.nodes.size(); i++) {
-            const BVHNode& node = bvh.nodes[i];
-            std::string name = "bvh_nodes[" + std::to_string(i) + "].";
-            set_uniform(name + "aabb.lb", node.aabb.lb);
-            set_uniform(name + "aabb.rt", node.aabb.rt);
-            set_uniform(name + "left", node.left);
-            set_uniform(name + "right", node.right);
-            set_uniform(name + "tri_start", node.tri_start);
-            set_uniform(name + "tri_end", node.tri_end);
-        }
+        params.params.set_camera(camera);
+        params.upload();
+    }
+    bool set_bvh(const BVH& bvh) {
+        if (!scene.upload(bvh)) return false;
+        set_uniform("triangles", SCENE_TEXTURE_UNIT);
+        set_uniform("tri_indices", SCENE_TEXTURE_UNIT + 1);
+        set_uniform("bvh_nodes", SCENE_TEXTURE_UNIT + 2);
+        return true;
+    }
+    void set_blue_noise(const BlueNoise& noise) {
+        // texture unit 0 holds the render target
+        glGenTextures(1, &noise_texture);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, noise_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, noise.size, noise.size, 0, GL_RED, GL_FLOAT,
+                     noise.values.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glActiveTexture(GL_TEXTURE0);
+        set_uniform("blue_noise", 1);
     }
 
     bool init_gl(const ivec2& resolution) {
         this->resolution = resolution;
 
-        // initialize GLFW
-        if (!glfwInit()) {
-            std::cerr << "Failed to initialize GLFW\n";
-            return false;
-        }
-
-        // create hidden window
-        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
-        window =
-            glfwCreateWindow(resolution.x, resolution.y, "pathtracer render target", NULL, NULL);
-        if (!window) {
-            std::cerr << "Failed to create GLFW window\n";
-            glfwTerminate();
-            return false;
-        }
-        glfwMakeContextCurrent(window);
-
-        // initialize GLEW
-        if (glewInit() != GLEW_OK) {
-            std::cerr << "Failed to initialize GLEW\n";
-            glfwTerminate();
-            return false;
-        }
+        // hidden window, or a headless context when there is no display
+        if (!gl.create(resolution, "pathtracer render target")) return false;
 
-        // create texture
+        // create float accumulation texture, rgb is the sum
+        // of the samples so far and alpha their count
         glGenTextures(1, &texture);
         glBindTexture(GL_TEXTURE_2D, texture);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, resolution.x, resolution.y, 0, GL_RGB,
-                     GL_UNSIGNED_BYTE, NULL);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, resolution.x, resolution.y, 0, GL_RGBA,
+                     GL_FLOAT, NULL);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
@@ -461,70 +747,77 @@ struct PathtraceShader {
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
         if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
             std::cerr << "Failed to create FBO\n";
-            glfwTerminate();
             return false;
         }
 
-        // compile shaders
-        vert_shader = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vert_shader, 1, &VERT_SOURCE, NULL);
-        glCompileShader(vert_shader);
-        frag_shader = glCreateShader(GL_FRAGMENT_SHADER);
+        // compile shaders, or load them from the binary cache
 #ifdef DEBUG
-        glShaderSource(frag_shader, 1, &test_frag_source, NULL);
+        const char* frag_source = test_frag_source;
 #else
-        glShaderSource(frag_shader, 1, &FRAG_SOURCE, NULL);
+        const char* frag_source = FRAG_SOURCE;
 #endif
-        glCompileShader(frag_shader);
-        shader = glCreateProgram();
-        glAttachShader(shader, vert_shader);
-        glAttachShader(shader, frag_shader);
-        glLinkProgram(shader);
+        shader = load_program({{GL_VERTEX_SHADER, VERT_SOURCE}, {GL_FRAGMENT_SHADER, frag_source}});
+        if (!shader) return false;
         glUseProgram(shader);
 
-        return true;
-    }
-    void draw_rect(const ivec2& top_left, const ivec2& bottom_right) {
-        // clamp top_left and bottom_right to resolution
-        ivec2 c_tl = component_max(top_left, ivec2(0));
-        ivec2 c_br = component_min(bottom_right, resolution);
-
-        // create vertices from top left and bottom right
-        vec2 tl = vec2(c_tl) / vec2(resolution) * 2 - 1;
-        vec2 tr = vec2(c_br.x, c_tl.y) / vec2(resolution) * 2 - 1;
-        vec2 bl = vec2(c_tl.x, c_br.y) / vec2(resolution) * 2 - 1;
-        vec2 br = vec2(c_br) / vec2(resolution) * 2 - 1;
-        std::array<float, 20> vertices = {
-            tl.x, tl.y, 0, 0, 0, tr.x, tr.y, 0, 0, 0, bl.x, bl.y, 0, 0, 0, br.x, br.y, 0, 0, 0,
-        };
-        const std::array<GLuint, 6> indices = {
-            0, 1, 3,  // first triangle
-            0, 2, 3   // second triangle
-        };
+        // passes add onto the accumulation texture, the aov attachments are just overwritten
+        glEnablei(GL_BLEND, 0);
+        glBlendFunc(GL_ONE, GL_ONE);
 
-        // create vao, vbo, ebo
+        // one quad for every draw
+        const std::array<float, 8> vertices = {-1, -1, 1, -1, -1, 1, 1, 1};
         glGenVertexArrays(1, &vao);
         glGenBuffers(1, &vbo);
-        glGenBuffers(1, &ebo);
         glBindVertexArray(vao);
         glBindBuffer(GL_ARRAY_BUFFER, vbo);
         glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(),
                      GL_STATIC_DRAW);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(),
-                     GL_STATIC_DRAW);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
         glEnableVertexAttribArray(0);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float),
-                              (void*)(3 * sizeof(float)));
-        glEnableVertexAttribArray(1);
-        glBindVertexArray(0);
+        glGenQueries(1, &timer_query);
+        glViewport(0, 0, resolution.x, resolution.y);
+
+        return true;
+    }
+    bool init_aovs() {
+        // float targets for the shader's first hit outputs
+        glGenTextures(2, aov_textures);
+        for (int i = 0; i < 2; i++) {
+            glBindTexture(GL_TEXTURE_2D, aov_textures[i]);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, resolution.x, resolution.y, 0, GL_RGBA,
+                         GL_FLOAT, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1 + i, GL_TEXTURE_2D,
+                                   aov_textures[i], 0);
+        }
+        glBindTexture(GL_TEXTURE_2D, texture);
+        const GLenum buffers[3] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
+                                   GL_COLOR_ATTACHMENT2};
+        glDrawBuffers(3, buffers);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cerr << "Failed to create AOV attachments\n";
+            return false;
+        }
+        return true;
+    }
+    void draw_rect(const ivec2& top_left, const ivec2& bottom_right) {
+        // clamp top_left and bottom_right to resolution
+        ivec2 c_tl = component_max(top_left, ivec2(0));
+        ivec2 c_br = component_min(bottom_right, resolution);
+        if (c_br.x <= c_tl.x || c_br.y <= c_tl.y) return;
 
-        // render to fbo
+        // render to fbo, only inside the rect
         glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-        glViewport(0, 0, resolution.x, resolution.y);  // ! maybe this can be moved to init_gl
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(c_tl.x, c_tl.y, c_br.x - c_tl.x, c_br.y - c_tl.y);
         glBindVertexArray(vao);
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glDisable(GL_SCISSOR_TEST);
+    }
+    float draw_rect_timed(const ivec2& top_left, const ivec2& bottom_right) {
+        // milliseconds the gpu spent on the rect, waits for it to finish
+        return timed_draw(timer_query, [&] { draw_rect(top_left, bottom_right); });
     }
     void clear_buffer(const vec3& color) {
         // clear fbo to color
@@ -532,41 +825,103 @@ struct PathtraceShader {
         glClearColor(color.x, color.y, color.z, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT);
     }
+    void reset() {
+        // drop every accumulated sample
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glClearColor(0, 0, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+    void set_pass(int samples, int sample_offset) {
+        // the next draws take samples more samples per pixel,
+        // continuing the sample sequence at sample_offset
+        params.params.render_samples = samples;
+        params.params.sample_offset = sample_offset;
+        params.upload();
+    }
     void finish() {
         // submit tasks to gpu
         glFinish();
     }
 
-    void save_ppm(const std::string& filename) {
+    void start_readback() {
+        // queues a copy of the accumulation buffer into the pixel buffer and
+        // returns right away, finish_readback waits for it and collects it
+        size_t bytes = size_t(resolution.x) * resolution.y * 4 * sizeof(float);
+        if (!pbo) {
+            glGenBuffers(1, &pbo);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+            glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
         glBindTexture(GL_TEXTURE_2D, texture);
-        std::vector<GLubyte> pixels(resolution.x * resolution.y * 3);
-        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
-
-        std::ofstream file(filename);
-        file << "P3\n" << resolution.x << " " << resolution.y << "\n255\n";
-        for (int i = 0; i < resolution.x * resolution.y * 3; i += 3) {
-            file << (int)pixels[i] << " ";
-            file << (int)pixels[i + 1] << " ";
-            file << (int)pixels[i + 2] << "\n";
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, NULL);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        if (readback_fence) glDeleteSync(readback_fence);
+        readback_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    Image finish_readback() {
+        // mean of the samples accumulated at start_readback, linear
+        // normalized straight out of the mapped buffer, without a staging copy
+        if (!readback_fence) start_readback();
+        glClientWaitSync(readback_fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(readback_fence);
+        readback_fence = 0;
+
+        Image image(resolution);
+        size_t bytes = image.pixels.size() * 4 * sizeof(float);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        const float* pixels = static_cast<const float*>(
+            glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT));
+        if (pixels) {
+            for (size_t p = 0; p < image.pixels.size(); p++) {
+                float count = pixels[p * 4 + 3];
+                float inv = count > 0 ? 1 / count : 0;
+                image.pixels[p] = vec3(pixels[p * 4], pixels[p * 4 + 1], pixels[p * 4 + 2]) * inv;
+            }
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        } else {
+            std::cerr << "Failed to map the readback buffer\n";
         }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        return image;
     }
-    void save_png(const std::string& filename) {
-        glBindTexture(GL_TEXTURE_2D, texture);
-        std::vector<GLubyte> pixels(resolution.x * resolution.y * 3);
-        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
-
-        // flip the image vertically
-        for (int y = 0; y < resolution.y / 2; y++) {
-            for (int x = 0; x < resolution.x; x++) {
-                for (int c = 0; c < 3; c++) {
-                    std::swap(pixels[(y * resolution.x + x) * 3 + c],
-                              pixels[((resolution.y - y - 1) * resolution.x + x) * 3 + c]);
+    Image read_image() {
+        start_readback();
+        return finish_readback();
+    }
+    std::vector<GLubyte> read_rgb8(const PostProcess& post = PostProcess(1)) {
+        // gamma corrected rgb8 rows, top row first
+        // the flip happens in the post process, which writes rows in output order
+        return read_image().to_rgb8(post);
+    }
+    bool save_ppm(const std::string& filename) {
+        // binary ppm
+        return read_image().save_ppm(filename, PostProcess(1));
+    }
+    AOVs read_aovs() {
+        // averaged over samples, material ids are left for AOVs::resolve_materials
+        AOVs aovs(resolution);
+        if (!aov_textures[0]) return aovs;
+        std::vector<float> pixels(size_t(resolution.x) * resolution.y * 4);
+        for (int i = 0; i < 2; i++) {
+            glBindTexture(GL_TEXTURE_2D, aov_textures[i]);
+            glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, pixels.data());
+            // gl textures start at the bottom row, same as Image
+            for (size_t p = 0; p < aovs.depth.size(); p++) {
+                vec3 rgb(pixels[p * 4], pixels[p * 4 + 1], pixels[p * 4 + 2]);
+                if (i == 0) {
+                    aovs.normal.pixels[p] = rgb;
+                    aovs.depth[p] = pixels[p * 4 + 3];
+                } else {
+                    aovs.albedo.pixels[p] = rgb;
+                    aovs.triangle_id[p] = static_cast<int>(pixels[p * 4 + 3]);
                 }
             }
         }
-
-        bool success = fpng::fpng_encode_image_to_file(filename.c_str(), pixels.data(),
-                                                       resolution.x, resolution.y, 3);
-        if (!success) std::cerr << "Failed to write image to file: " << filename << '\n';
+        glBindTexture(GL_TEXTURE_2D, texture);
+        return aovs;
+    }
+    bool save_png(const std::string& filename) {
+        return read_image().save_png(filename, PostProcess(1));
     }
 };
\ No newline at end of file
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "exr.h"
+#include "linalg.h"
+
+float luminance(const vec3& color) {
+    // rec. 709
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+// per pixel sample statistics of the luminance, for estimating how noisy
+// each pixel still is (and the image as a whole)
+// moments are kept with welford's update, which stays accurate at high
+// sample counts where a plain sum of squares would cancel out
+struct PixelStats {
+    ivec2 res;
+    std::vector<uint32_t> count;
+    std::vector<float> mean, m2;  // running mean and sum of squared deviations
+
+    PixelStats() = default;
+    PixelStats(const ivec2& resolution)
+        : res(resolution),
+          count(size_t(resolution.x) * resolution.y, 0),
+          mean(count.size(), 0),
+          m2(count.size(), 0) {}
+
+    bool empty() const {
+        return count.empty();
+    }
+    void add(int w, int h, const vec3& color) {
+        size_t i = size_t(h) * res.x + w;
+        float y = luminance(color);
+        float delta = y - mean[i];
+        mean[i] += delta / ++count[i];
+        m2[i] += delta * (y - mean[i]);
+    }
+
+    // unbiased variance of a single sample
+    float variance(size_t i) const {
+        return count[i] > 1 ? m2[i] / (count[i] - 1) : 0;
+    }
+    // variance of the pixel's estimate (the mean over its samples),
+    // what is left as noise in the final image
+    float error(size_t i) const {
+        return count[i] > 0 ? variance(i) / count[i] : 0;
+    }
+    // average of error over the image, a single noise figure for the render
+    float mean_error() const {
+        double sum = 0;
+        for (size_t i = 0; i < count.size(); i++) sum += error(i);
+        return count.empty() ? 0 : sum / count.size();
+    }
+
+    // variance map as exr: sample count, mean luminance
+    // and the variance of each pixel's estimate
+    bool save(const std::string& filename) const {
+        ExrWriter exr;
+        bool success = exr.open(filename, res,
+                                {{"samples", ExrWriter::UINT},
+                                 {"mean", ExrWriter::FLOAT},
+                                 {"variance", ExrWriter::FLOAT}});
+        std::vector<float> line(size_t(res.x) * 3);
+        const float* planes[3] = {&line[0], &line[res.x], &line[2 * size_t(res.x)]};
+        // exr lines go top to bottom
+        for (int h = res.y - 1; success && h >= 0; h--) {
+            for (int w = 0; w < res.x; w++) {
+                size_t i = size_t(h) * res.x + w;
+                line[w] = count[i];
+                line[res.x + w] = mean[i];
+                line[2 * res.x + w] = error(i);
+            }
+            exr.write_line(planes);
+        }
+        success = success && exr.close();
+        if (!success) std::cerr << "Failed to write image to file: " << filename << '\n';
+        return success;
+    }
+};
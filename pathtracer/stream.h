@@ -0,0 +1,165 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "exr.h"
+#include "fpng.h"
+#include "image.h"
+#include "linalg.h"
+#include "postprocess.h"
+
+#define STREAM_BAND_ROWS 16
+
+// output for renders too large to keep in memory
+// the image arrives as bands of rows, each band is written out
+// (or copied into a memory mapped file) and can then be dropped
+// - png, ppm and exr are scanline encoders, bands have to come top to bottom
+// - pfm is memory mapped, bands can come in any order
+struct StreamWriter {
+    enum Format {
+        PNG,
+        PPM,
+        EXR,
+        PFM,
+    } format;
+    ivec2 res;
+    int samples = 1;
+    PostProcess post;
+    std::string filename;
+
+    fpng::fpng_stream_writer png;
+    std::ofstream ppm;
+    ExrWriter exr;
+    int fd = -1;
+    char* map = nullptr;
+    size_t map_size = 0, map_header = 0;
+    std::vector<unsigned char> rgb8;
+
+    StreamWriter() = default;
+    StreamWriter(const StreamWriter&) = delete;
+    StreamWriter& operator=(const StreamWriter&) = delete;
+    ~StreamWriter() {
+        unmap();
+    }
+
+    bool open(const std::string& filename, const ivec2& resolution, int samples = 1,
+              PostProcess post = PostProcess(1)) {
+        // same formats and scaling as Image::save
+        this->filename = filename;
+        this->res = resolution;
+        this->samples = samples;
+        this->post = post;
+        this->post.scale /= samples;
+
+        bool success;
+        if (ends_with(filename, ".exr")) {
+            format = EXR;
+            success = exr.open(filename, res, false, {{"samples", samples}});
+        } else if (ends_with(filename, ".pfm")) {
+            format = PFM;
+            success = map_pfm();
+        } else if (ends_with(filename, ".ppm")) {
+            format = PPM;
+            ppm.open(filename, std::ios::binary);
+            ppm << "P6\n" << res.x << " " << res.y << "\n255\n";
+            success = bool(ppm);
+        } else {
+            format = PNG;
+            success = png.open(filename.c_str(), res.x, res.y, 3);
+        }
+        if (!success) std::cerr << "Failed to open image file: " << filename << '\n';
+        return success;
+    }
+
+    // band holds band.res.y full rows starting at row h (row 0 is the bottom)
+    bool write_band(const Image& band, int h) {
+        if (band.res.x != res.x || h < 0 || h + band.res.y > res.y) return false;
+
+        bool success = true;
+        switch (format) {
+            case PNG:
+            case PPM:
+                rgb8.resize(band.channels());
+                post.apply(band.data(), band.res, rgb8.data());
+                if (format == PNG)
+                    success = png.add_rows(rgb8.data(), band.res.y);
+                else
+                    success = bool(ppm.write(reinterpret_cast<const char*>(rgb8.data()),
+                                             rgb8.size()));
+                break;
+            case EXR:
+                for (int r = band.res.y - 1; r >= 0; r--)
+                    exr.write_line(&band.pixel(0, r).x, 1.0f / samples);
+                success = bool(exr.out);
+                break;
+            case PFM: {
+                // pfm rows are stored bottom to top like ours
+                float inv = 1.0f / samples;
+                size_t row_floats = size_t(res.x) * 3;
+                for (int r = 0; r < band.res.y; r++) {
+                    float* dst = reinterpret_cast<float*>(
+                        map + map_header + (size_t(h) + r) * row_floats * sizeof(float));
+                    const float* src = &band.pixel(0, r).x;
+                    for (size_t i = 0; i < row_floats; i++) dst[i] = src[i] * inv;
+                }
+                break;
+            }
+        }
+        if (!success) std::cerr << "Failed to write image to file: " << filename << '\n';
+        return success;
+    }
+
+    bool close() {
+        bool success = true;
+        switch (format) {
+            case PNG:
+                success = png.close();
+                break;
+            case PPM:
+                ppm.close();
+                success = !ppm.fail();
+                break;
+            case EXR:
+                success = exr.close();
+                break;
+            case PFM:
+                success = unmap();
+                break;
+        }
+        if (!success) std::cerr << "Failed to write image to file: " << filename << '\n';
+        return success;
+    }
+
+    bool map_pfm() {
+        std::string header =
+            "PF\n" + std::to_string(res.x) + " " + std::to_string(res.y) + "\n-1.0\n";
+        map_header = header.size();
+        map_size = map_header + size_t(res.x) * res.y * 3 * sizeof(float);
+
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) return false;
+        // the file is sized up front, pages are only backed by disk as they get written
+        if (ftruncate(fd, map_size) != 0) return false;
+        void* ptr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) return false;
+        map = static_cast<char*>(ptr);
+        std::memcpy(map, header.data(), map_header);
+        return true;
+    }
+    bool unmap() {
+        bool success = true;
+        if (map) success = munmap(map, map_size) == 0;
+        if (fd != -1) success = ::close(fd) == 0 && success;
+        map = nullptr;
+        fd = -1;
+        return success;
+    }
+};
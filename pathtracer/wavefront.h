@@ -0,0 +1,557 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "bvh.h"
+#include "camera.h"
+#include "context.h"
+#include "image.h"
+#include "linalg.h"
+#include "program_cache.h"
+#include "sampler.h"
+#include "shader.h"
+
+#define WAVEFRONT_GROUP_SIZE 64        // same as GROUP_SIZE in WAVEFRONT_SOURCE
+#define WAVEFRONT_PATH_BYTES 64        // size of a Path in WAVEFRONT_SOURCE
+#define WAVEFRONT_WAVE_SIZE (1 << 20)  // paths in flight at once
+
+// mirror of wavefront.comp, see the note on glsl sources in shader.h
+const char* WAVEFRONT_SOURCE = R"glsl(#version 430 core
+
+// wavefront path tracer, see WavefrontShader in wavefront.h
+// every stage is its own dispatch, the host compiles this once per stage
+// with one of GENERATE, INTERSECT, SHADE or ACCUMULATE defined
+// - generate: one camera ray per pixel of the wave, all of them queued
+// - intersect: closest hit for every queued path
+// - shade: adds emission, bounces and queues the paths that go on
+// - accumulate: adds the finished paths onto the image
+// scene layout, sampling and shading are the same as in shader.frag
+
+#define GROUP_SIZE 64
+layout(local_size_x = GROUP_SIZE) in;
+
+const float PI = 3.1415926538f;
+const float PI_2 = 1.5707963268f;
+const float FLOAT_INF = 1e30f;
+const float BIAS = 1e-4f;
+const float EPS = 1e-6f;
+
+// blue noise tile and R4 lattice, see BlueNoise in sampler.h
+layout(binding = 1) uniform sampler2D blue_noise;
+const uint LATTICE[4] = uint[4](0xdb4f0b91u, 0xbbe05633u, 0xa0f2ec75u, 0x89e18285u);
+const ivec2 DIM_OFFSET = ivec2(23, 41);
+const int DIM_PIXEL = 0;
+const int DIM_BOUNCE = 2;
+
+struct Camera {
+    vec3 pos;
+    ivec2 res;
+    vec2 v_res;
+    float cell_size;
+    float image_distance;
+    mat4 transform;
+};
+// same block as in shader.frag, sample_offset is the sample being taken
+layout(std140, binding = 0) uniform RenderParams {
+    Camera camera;
+    int render_samples;
+    int render_depth;
+    int frame;
+    int sample_offset;
+};
+// the wave covers wave_size consecutive pixels from wave_start, path i is pixel wave_start + i
+uniform int wave_start;
+uniform int wave_size;
+
+const int EMIT = 1;
+const int DIFF = 2; // diffuse
+const int SPEC = 3; // specular
+struct Material {
+    int type;
+    vec3 color, emit_color;
+    float roughness;
+};
+struct AABB {
+    vec3 lb, rt;
+};
+// see ThreadedNode in bvh.h
+struct BVHNode {
+    AABB aabb;
+    int escape;
+    int tri_start, tri_end; // -1 for inner nodes
+};
+
+// the buffers behind SceneBuffers, read as storage buffers
+// - triangles: 5 vec4 each, (v1, type) (v2, roughness) (v3, 0) (color, 0) (emit_color, 0)
+// - tri_indices: one int per triangle in bvh order
+// - bvh_nodes: threaded layout, 3 vec4 each, (lb, escape) (rt, tri_start) (tri_end, 0, 0, 0)
+//   with the ints stored as float bits
+layout(std430, binding = 0) readonly buffer Triangles {
+    vec4 triangles[];
+};
+layout(std430, binding = 1) readonly buffer TriIndices {
+    int tri_indices[];
+};
+layout(std430, binding = 2) readonly buffer BVHNodes {
+    vec4 bvh_nodes[];
+};
+
+struct Path {
+    vec3 origin;
+    uint seed;
+    vec3 direction;
+    int bounce;
+    vec3 throughput;
+    float hit_t;
+    vec3 radiance;
+    int hit_tri; // -1 if the last ray missed
+};
+layout(std430, binding = 3) buffer Paths {
+    Path paths[];
+};
+// queues of path indices, headed by the indirect dispatch arguments
+// for the stages that read them
+layout(std430, binding = 4) buffer InQueue {
+    uint in_groups_x, in_groups_y, in_groups_z;
+    uint in_count;
+    uint in_paths[];
+};
+layout(std430, binding = 5) buffer OutQueue {
+    uint out_groups_x, out_groups_y, out_groups_z;
+    uint out_count;
+    uint out_paths[];
+};
+// per pixel, rgb is the sum of the samples so far and alpha their count
+layout(std430, binding = 6) buffer Accumulation {
+    vec4 accumulation[];
+};
+// per pixel rng state, carried from one sample to the next
+layout(std430, binding = 7) buffer Seeds {
+    uint seeds[];
+};
+
+vec3 tri_vertex(int tri_idx, int v) {
+    return triangles[tri_idx * 5 + v].xyz;
+}
+Material load_material(int tri_idx) {
+    vec4 t0 = triangles[tri_idx * 5];
+    vec4 t1 = triangles[tri_idx * 5 + 1];
+    vec3 color = triangles[tri_idx * 5 + 3].xyz;
+    vec3 emit_color = triangles[tri_idx * 5 + 4].xyz;
+    return Material(int(t0.w), color, emit_color, t1.w);
+}
+BVHNode load_node(int node_idx) {
+    vec4 t0 = bvh_nodes[node_idx * 3];
+    vec4 t1 = bvh_nodes[node_idx * 3 + 1];
+    int tri_end = floatBitsToInt(bvh_nodes[node_idx * 3 + 2].x);
+    return BVHNode(AABB(t0.xyz, t1.xyz), floatBitsToInt(t0.w), floatBitsToInt(t1.w), tri_end);
+}
+
+ivec2 pixel_of(uint path) {
+    int p = wave_start + int(path);
+    return ivec2(p % camera.res.x, p / camera.res.x);
+}
+
+float rand01(inout uint state) {
+    state ^= 2747636419u;
+    state *= 2654435769u;
+    state ^= state >> 16;
+    state *= 2654435769u;
+    state ^= state >> 16;
+    state *= 2654435769u;
+    return float(state) / 4294967295.0;
+}
+
+float blue_noise_sample(ivec2 pixel, uint index, int dim) {
+    ivec2 size = textureSize(blue_noise, 0);
+    ivec2 p = (pixel + dim * DIM_OFFSET) % size;
+    float offset = texelFetch(blue_noise, p, 0).r;
+    float lattice = float((index * LATTICE[dim]) >> 8u) / 16777216.0;
+    return fract(offset + lattice);
+}
+vec2 blue_noise_sample2d(ivec2 pixel, uint index, int dim) {
+    return vec2(blue_noise_sample(pixel, index, dim), blue_noise_sample(pixel, index, dim + 1));
+}
+
+bool i_tri(vec3 ray_o, vec3 ray_d, int tri_idx, out float t) {
+    vec3 v1 = tri_vertex(tri_idx, 0);
+    vec3 v2 = tri_vertex(tri_idx, 1);
+    vec3 v3 = tri_vertex(tri_idx, 2);
+
+    vec3 edge1 = v2 - v1, edge2 = v3 - v1;
+    vec3 h = cross(ray_d, edge2);
+    float a = dot(edge1, h);
+    if (abs(a) < EPS)
+        return false;
+
+    float f = 1.0f / a;
+    vec3 s = ray_o - v1;
+    float u = f * dot(s, h);
+    if (u < 0 || u > 1)
+        return false;
+
+    vec3 q = cross(s, edge1);
+    float v = f * dot(ray_d, q);
+    if (v < 0 || u + v > 1)
+        return false;
+
+    t = f * dot(edge2, q);
+    return t > 0;
+}
+vec3 n_tri(vec3 ray_d, int tri_idx) {
+    vec3 v1 = tri_vertex(tri_idx, 0);
+    vec3 v2 = tri_vertex(tri_idx, 1);
+    vec3 v3 = tri_vertex(tri_idx, 2);
+
+    vec3 n = normalize(cross(v2 - v1, v3 - v1));
+    return dot(n, ray_d) < 0 ? n : -n;
+}
+
+bool i_aabb(vec3 ray_o, vec3 inv_ray_d, AABB aabb) {
+    vec3 t1 = (aabb.lb - ray_o) * inv_ray_d;
+    vec3 t2 = (aabb.rt - ray_o) * inv_ray_d;
+    vec3 t_far = max(t1, t2), t_near = min(t1, t2);
+
+    float tmax = min(min(t_far.x, t_far.y), t_far.z);
+    float tmin = max(max(t_near.x, t_near.y), t_near.z);
+    return tmax >= 0 && tmin <= tmax;
+}
+int i_bvh(vec3 ray_o, vec3 ray_d, out float t) {
+    // index of the closest triangle along the ray, -1 if none
+    // stackless walk over the threaded bvh: a hit inner node
+    // goes on to the next node, everything else to its escape
+    vec3 inv_ray_d = 1 / ray_d;
+    int ret = -1;
+    float min_t = FLOAT_INF;
+
+    int node_count = bvh_nodes.length() / 3;
+    int idx = 0;
+    while (idx < node_count) {
+        BVHNode cur = load_node(idx);
+        if (!i_aabb(ray_o, inv_ray_d, cur.aabb)) {
+            idx = cur.escape;
+        } else if (cur.tri_start != -1) {
+            for (int i = cur.tri_start; i <= cur.tri_end; i++) {
+                int tri_idx = tri_indices[i];
+                float t_;
+                if (i_tri(ray_o, ray_d, tri_idx, t_) && t_ < min_t) {
+                    min_t = t_;
+                    ret = tri_idx;
+                }
+            }
+            idx = cur.escape;
+        } else {
+            idx++;
+        }
+    }
+
+    t = min_t;
+    return ret;
+}
+
+vec3 reflect_d(vec3 ray_d, vec3 normal, Material material, vec2 rnd, inout uint seed) {
+    if (material.type == SPEC) {
+        // specular with noise
+        vec3 reflected = reflect(ray_d, normal);
+        vec3 ret;
+        do {
+            vec3 jitter = (vec3(rand01(seed), rand01(seed), rand01(seed)) - 0.5f) * material.roughness;
+            ret = normalize(reflected + jitter);
+        } while (dot(ret, normal) < 0);
+        return ret;
+    } else {
+        // lambertian diffuse
+        float theta = acos(2 * rnd.x - 1) - PI_2;
+        float phi = 2 * PI * rnd.y;
+        vec3 d = vec3(cos(theta) * cos(phi), cos(theta) * sin(phi), sin(theta));
+        return sign(dot(d, normal)) * d;
+    }
+}
+
+vec3 camera_ray(ivec2 pixel, vec2 rnd) {
+    vec2 jitter = rnd * camera.cell_size;
+    vec3 ray_d = vec3(pixel.x * camera.cell_size - camera.v_res.x / 2 + jitter.x, pixel.y * camera.cell_size - camera.v_res.y / 2 + jitter.y, -camera.image_distance);
+    return normalize(mat3(camera.transform) * ray_d);
+}
+
+#ifdef GENERATE
+void main() {
+    uint id = gl_GlobalInvocationID.x;
+    if (id >= uint(wave_size))
+        return;
+    ivec2 pixel = pixel_of(id);
+    int p = wave_start + int(id);
+
+    Path path;
+    // same seeds as the fragment kernel at pixel centers, acts weird if seed = 0
+    path.seed = sample_offset == 0 ? uint(pixel.y + 0.5 + (pixel.x + 0.5) * camera.res.y + 1) : seeds[p];
+    path.origin = camera.pos;
+    path.direction = camera_ray(pixel, blue_noise_sample2d(pixel, uint(sample_offset), DIM_PIXEL));
+    path.bounce = 0;
+    path.throughput = vec3(1);
+    path.hit_t = FLOAT_INF;
+    path.radiance = vec3(0);
+    path.hit_tri = -1;
+    paths[id] = path;
+    in_paths[id] = id;
+}
+#endif
+
+#ifdef INTERSECT
+void main() {
+    uint id = gl_GlobalInvocationID.x;
+    if (id >= in_count)
+        return;
+    uint p = in_paths[id];
+    float t;
+    paths[p].hit_tri = i_bvh(paths[p].origin, paths[p].direction, t);
+    paths[p].hit_t = t;
+}
+#endif
+
+#ifdef SHADE
+void main() {
+    uint id = gl_GlobalInvocationID.x;
+    if (id >= in_count)
+        return;
+    uint p = in_paths[id];
+    Path path = paths[p];
+    if (path.hit_tri == -1)
+        return;
+
+    Material material = load_material(path.hit_tri);
+    path.radiance += path.throughput * material.emit_color;
+    if (material.type != EMIT) {
+        vec3 hit_p = path.origin + path.direction * path.hit_t;
+        vec3 hit_n = n_tri(path.direction, path.hit_tri);
+        // the first bounce is blue noise, the rest is random
+        vec2 rnd = path.bounce == 0 ? blue_noise_sample2d(pixel_of(p), uint(sample_offset), DIM_BOUNCE) : vec2(rand01(path.seed), rand01(path.seed));
+        path.origin = hit_p + hit_n * BIAS;
+        path.direction = reflect_d(path.direction, hit_n, material, rnd, path.seed);
+        // multiply by 2 to account for cosine weighted hemisphere
+        path.throughput *= 2 * material.color * dot(hit_n, path.direction);
+        path.bounce++;
+
+        // the last bounce still draws its numbers to keep the rng in step with shader.frag
+        if (path.bounce < render_depth) {
+            uint slot = atomicAdd(out_count, 1u);
+            if (slot % GROUP_SIZE == 0)
+                atomicAdd(out_groups_x, 1u);
+            out_paths[slot] = p;
+        }
+    }
+    paths[p] = path;
+}
+#endif
+
+#ifdef ACCUMULATE
+void main() {
+    uint id = gl_GlobalInvocationID.x;
+    if (id >= uint(wave_size))
+        return;
+    int p = wave_start + int(id);
+    accumulation[p] += vec4(paths[id].radiance, 1);
+    seeds[p] = paths[id].seed;
+}
+#endif
+)glsl";
+
+// path tracer on gl 4.3 compute shaders, split into small kernels instead of
+// the one big fragment shader of PathtraceShader
+// - a sample is taken for a wave of pixels at a time: generate fills the path
+//   buffer, intersect and shade run once per bounce on a queue of the paths
+//   still alive, accumulate adds the finished paths onto the image
+// - each queue starts with the indirect dispatch arguments for the stages that
+//   read it, so queue lengths never travel back to the host
+// - scene and parameters are the SceneBuffers and RenderParams of PathtraceShader,
+//   the scene buffers are read as storage buffers
+// gives the same image as a single pass of PathtraceShader, up to float rounding
+struct WavefrontShader {
+    enum Stage { GENERATE, INTERSECT, SHADE, ACCUMULATE, STAGES };
+
+    GLContext gl;
+    ivec2 resolution;
+    int depth;
+    int wave_size;
+    GLuint programs[STAGES] = {0, 0, 0, 0};
+    GLint wave_start_locs[STAGES], wave_size_locs[STAGES];
+    GLuint paths = 0, accumulation = 0, seeds = 0;
+    GLuint queues[2] = {0, 0};
+    GLuint noise_texture = 0;
+    SceneBuffers scene;
+    ParamsBuffer params;
+
+    WavefrontShader(const Camera& camera, BVH& bvh, int depth)
+        : resolution(camera.res), depth(depth) {
+        if (!init_gl()) throw std::runtime_error("Failed to initialize WavefrontShader");
+
+        if (!bvh.built) {
+            std::cerr << "Warning: BVH not built\nBuilding BVH...\n";
+            bvh.build();
+        }
+
+        if (!params.create(programs[GENERATE]))
+            throw std::runtime_error("Failed to create RenderParams");
+        if (!scene.upload(bvh)) throw std::runtime_error("Failed to upload scene to WavefrontShader");
+        for (int i = 0; i < 3; i++) glBindBufferBase(GL_SHADER_STORAGE_BUFFER, i, scene.buffers[i]);
+        init_buffers();
+        set_blue_noise(blue_noise());
+        params.params.render_samples = 1;
+        params.params.render_depth = depth;
+        params.params.set_camera(camera);
+        params.upload();
+        reset();
+    }
+    ~WavefrontShader() {
+        for (GLuint program : programs) glDeleteProgram(program);
+        glDeleteBuffers(1, &paths);
+        glDeleteBuffers(2, queues);
+        glDeleteBuffers(1, &accumulation);
+        glDeleteBuffers(1, &seeds);
+        glDeleteTextures(1, &noise_texture);
+        scene.release();
+        params.release();
+    }
+
+    static GLuint compile(const char* stage) {
+        // the stage define has to follow the #version line, which is commented out
+        std::string source = std::string("#version 430 core\n#define ") + stage + "\n//" +
+                             WAVEFRONT_SOURCE;
+        return load_program({{GL_COMPUTE_SHADER, source}});
+    }
+    bool init_gl() {
+        // compute shaders need a 4.3 context
+        if (!gl.create(resolution, "pathtracer wavefront", 4, 3)) {
+            std::cerr << "Failed to create an OpenGL 4.3 context\n";
+            return false;
+        }
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        if (major * 10 + minor < 43) {
+            std::cerr << "Compute shaders need OpenGL 4.3, got " << major << '.' << minor << '\n';
+            return false;
+        }
+
+        const char* stages[STAGES] = {"GENERATE", "INTERSECT", "SHADE", "ACCUMULATE"};
+        for (int i = 0; i < STAGES; i++) {
+            programs[i] = compile(stages[i]);
+            if (!programs[i]) return false;
+            wave_start_locs[i] = glGetUniformLocation(programs[i], "wave_start");
+            wave_size_locs[i] = glGetUniformLocation(programs[i], "wave_size");
+        }
+        return true;
+    }
+    void init_buffers() {
+        size_t pixels = size_t(resolution.x) * resolution.y;
+        wave_size = static_cast<int>(std::min<size_t>(pixels, WAVEFRONT_WAVE_SIZE));
+
+        // paths and queues for one wave, accumulation and seeds for the whole image
+        auto create = [](GLuint& buffer, size_t bytes, int binding) {
+            glGenBuffers(1, &buffer);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, NULL, GL_DYNAMIC_COPY);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
+        };
+        create(paths, size_t(wave_size) * WAVEFRONT_PATH_BYTES, 3);
+        create(queues[0], (4 + size_t(wave_size)) * sizeof(GLuint), 4);
+        create(queues[1], (4 + size_t(wave_size)) * sizeof(GLuint), 5);
+        create(accumulation, pixels * 4 * sizeof(float), 6);
+        create(seeds, pixels * sizeof(GLuint), 7);
+    }
+    void set_blue_noise(const BlueNoise& noise) {
+        // bound to unit 1 in WAVEFRONT_SOURCE
+        glGenTextures(1, &noise_texture);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, noise_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, noise.size, noise.size, 0, GL_RED, GL_FLOAT,
+                     noise.values.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    void reset() {
+        // drop every accumulated sample
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, accumulation);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32F, GL_RED, GL_FLOAT, NULL);
+    }
+    static int groups(int count) {
+        return (count + WAVEFRONT_GROUP_SIZE - 1) / WAVEFRONT_GROUP_SIZE;
+    }
+    void reset_queue(int queue, int count) {
+        // indirect arguments for count paths, then the count
+        const GLuint header[4] = {GLuint(groups(count)), 1, 1, GLuint(count)};
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, queues[queue]);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(header), header);
+    }
+    void dispatch(Stage stage, int count) {
+        glUseProgram(programs[stage]);
+        glDispatchCompute(groups(count), 1, 1);
+        barrier();
+    }
+    void dispatch_indirect(Stage stage, int queue) {
+        // as many groups as the queue has paths, counted on the gpu
+        glUseProgram(programs[stage]);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, queues[queue]);
+        glDispatchComputeIndirect(0);
+        barrier();
+    }
+    static void barrier() {
+        // later stages, indirect arguments and queue resets all see the writes
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT |
+                        GL_BUFFER_UPDATE_BARRIER_BIT);
+    }
+
+    void sample(int index) {
+        // adds sample number index to every pixel
+        params.params.sample_offset = index;
+        params.upload();
+        long long pixels = (long long)resolution.x * resolution.y;
+        for (long long start = 0; start < pixels; start += wave_size) {
+            int size = static_cast<int>(std::min<long long>(wave_size, pixels - start));
+            for (int i = 0; i < STAGES; i++) {
+                glProgramUniform1i(programs[i], wave_start_locs[i], static_cast<int>(start));
+                glProgramUniform1i(programs[i], wave_size_locs[i], size);
+            }
+
+            // generate queues every path, each bounce shades into the other queue
+            int in = 0;
+            reset_queue(in, size);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, queues[in]);
+            dispatch(GENERATE, size);
+            for (int bounce = 0; bounce < depth; bounce++) {
+                reset_queue(1 - in, 0);
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, queues[in]);
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, queues[1 - in]);
+                dispatch_indirect(INTERSECT, in);
+                dispatch_indirect(SHADE, in);
+                in = 1 - in;
+            }
+            dispatch(ACCUMULATE, size);
+        }
+    }
+    void finish() {
+        glFinish();
+    }
+
+    Image read_image() {
+        // mean of the accumulated samples, linear
+        Image image(resolution);
+        std::vector<float> pixels(image.pixels.size() * 4);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, accumulation);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, pixels.size() * sizeof(float),
+                           pixels.data());
+        for (size_t p = 0; p < image.pixels.size(); p++) {
+            float count = pixels[p * 4 + 3];
+            float inv = count > 0 ? 1 / count : 0;
+            image.pixels[p] = vec3(pixels[p * 4], pixels[p * 4 + 1], pixels[p * 4 + 2]) * inv;
+        }
+        return image;
+    }
+};
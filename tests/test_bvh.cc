@@ -0,0 +1,43 @@
+#include <iostream>
+#include <random>
+
+#include "pathtracer/pathtracer.h"
+
+// intersect_stackless walks the threaded layout and has to give exactly the
+// hits the stack traversal does, the renderers rely on the two agreeing
+int main() {
+    std::mt19937 gen(SEED);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    auto random_vec3 = [&] { return vec3(uniform(gen), uniform(gen), uniform(gen)); };
+
+    // a cloud of small triangles, deep enough for a few levels of the tree
+    BVH bvh;
+    Material material(Material::DIFFUSE, vec3(1, 1, 1), 0, 0);
+    for (int i = 0; i < 4096; i++) {
+        vec3 a = random_vec3() * 4;
+        bvh.add_triangle(Triangle(a, a + (random_vec3() - 0.5f) * 0.3f,
+                                  a + (random_vec3() - 0.5f) * 0.3f, material));
+    }
+    bvh.build();
+
+    int rays = 100000, hits = 0, mismatches = 0;
+    for (int i = 0; i < rays; i++) {
+        // from around the cloud towards a point in it
+        vec3 ray_o = random_vec3() * 6 - 1;
+        vec3 ray_d = (random_vec3() * 4 - ray_o).normalize();
+        float t, t_stackless;
+        int hit = bvh.intersect(ray_o, ray_d, t);
+        int hit_stackless = bvh.intersect_stackless(ray_o, ray_d, t_stackless);
+        if (hit != -1) hits++;
+        if (hit != hit_stackless || (hit != -1 && t != t_stackless)) {
+            if (mismatches++ < 10) {
+                std::cout << "Ray " << i << ": intersect hit " << hit << " at " << t
+                          << ", intersect_stackless hit " << hit_stackless << " at "
+                          << t_stackless << '\n';
+            }
+        }
+    }
+
+    std::cout << hits << '/' << rays << " rays hit, " << mismatches << " mismatches.\n";
+    return mismatches == 0 ? 0 : 1;
+}
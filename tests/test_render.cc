@@ -20,5 +20,7 @@ int main(int argc, char** argv) {
     bvh.build();
 
     render_gpu(camera, bvh, 500, 5, ivec2(200, 200), argv[1] + std::string(".gpu.png"));
+    render_gpu_wavefront(camera, bvh, 500, 5, argv[1] + std::string(".wavefront.png"));
+    render_hybrid(camera, bvh, 500, 5, ivec2(200, 200), argv[1] + std::string(".hybrid.png"));
     render_cpu(camera, bvh, 500, 5, argv[1] + std::string(".cpu.png"));
 }
\ No newline at end of file